@@ -17,6 +17,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "poll.h"
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
@@ -50,6 +51,8 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+
+  struct waitq wq;  // poll()s waiting for a line
 } cons;
 
 //
@@ -109,7 +112,7 @@ consoleread(int user_dst, uint64 dst, int n)
 
     // copy the input byte to the user-space buffer.
     cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    if(either_copyout_locked(user_dst, dst, &cbuf, 1) == -1)
       break;
 
     dst++;
@@ -126,6 +129,24 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+//
+// poll()s of the console come here. input is ready once
+// a whole line (or end-of-file) has arrived; output never
+// blocks.
+//
+int
+consolepoll(int events, struct pollent *e)
+{
+  int r = events & POLLOUT;
+
+  acquire(&cons.lock);
+  pollwait(&cons.wq, &cons.lock, e);
+  if(cons.r != cons.w)
+    r |= events & POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +191,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake(&cons.wq);
       }
     }
     break;
@@ -185,8 +207,9 @@ consoleinit(void)
 
   uartinit();
 
-  // connect read and write system calls
-  // to consoleread and consolewrite.
+  // connect read, write and poll system calls
+  // to consoleread, consolewrite and consolepoll.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
@@ -2,8 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
+struct pollent;
+struct pollfd;
+struct waitq;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct schedinfo;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -31,8 +37,12 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+int             filereadv(struct file*, struct iovec*, int, int);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewritev(struct file*, struct iovec*, int, int);
+int             filesplice(struct file*, struct file*, int);
+int             filepoll(struct file*, int, struct pollent*);
 
 // fs.c
 void            fsinit(int);
@@ -50,9 +60,11 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readipipe(struct inode*, struct pipe*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             ireclaim(void);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -63,6 +75,13 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_zeroed(void);
+int             kzero(void);
+void            kref(void*);
+int             krefcnt(void*);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,23 +89,50 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+void            futexmoved(uint64);
+
+// pcache.c
+void            pcacheinit(void);
+char*           pcache_get(struct inode*, uint, uint);
+void            pcache_write(struct inode*, uint, void*, uint);
+void            pcache_invalidate(struct inode*);
+int             pcache_evict(void);
+int             pcachestats(char*, int);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipewait(struct pipe*);
+int             pipeput(struct pipe*, char*, int);
+int             pipeget(struct pipe*, char*, int);
+int             pipepoll(struct pipe*, int, int, struct pollent*);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// poll.c
+void            pollinit(void);
+void            pollwait(struct waitq*, struct spinlock*, struct pollent*);
+void            pollwake(struct waitq*);
+int             pollfiles(struct pollfd*, int, int);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             clone(uint64, uint64, uint64);
+int             join(int, uint64);
+uint64          growproc(int);
+int             procreclaim(void);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -100,8 +146,17 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
+void            wakeuprange(void*, void*);
 void            yield(void);
+int             schedstats(char*, int);
+int             timeslice(void);
+int             nice(int);
+int             setaffinity(int, uint);
+int             getaffinity(int);
+int             schedinfo(int, struct schedinfo*);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
+int             either_copyout_locked(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
@@ -115,6 +170,9 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             snprint_lock(char*, int, struct spinlock*);
+int             statslock(char*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -131,6 +189,20 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_reap(void);
+int             slabstats(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -139,12 +211,23 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            theapinit(void);
+uint64          timernext(void);
+void            timerexpire(void);
+int             sleep_ns(uint64);
+int             sleep_until(void*, struct spinlock*, uint64);
+
 // trap.c
 extern uint     ticks;
+extern uint64   wakeat;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            clockintr(void);
+void            timerset(uint64);
+void            ipi(int);
 
 // uart.c
 void            uartinit(void);
@@ -158,6 +241,10 @@ void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             vmstats(char*, int);
+int             kvmstack(uint64);
+int             kvmunstack(uint64);
+void            kvmsync(void);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
@@ -166,9 +253,21 @@ int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+uint64          uvmasid(struct proc*);
+uint64          uvmpin(pagetable_t, uint64, int, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             copyout_locked(pagetable_t, uint64, char *, uint64);
+int             cowfault(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int, int);
+void            vmaprefault(uint64, uint64, int);
+int             vmadup(struct proc*, struct proc*);
+void            vmafree(struct proc*);
+int             vmaoverlap(struct proc*, uint64, uint64);
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
+int             copyin_locked(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
 // plic.c
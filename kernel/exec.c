@@ -3,11 +3,13 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+static int perm(int flags);
 
 int
 exec(char *path, char **argv)
@@ -20,6 +22,15 @@ exec(char *path, char **argv)
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
+  struct vma vma[NVMA], *v;
+
+  // other threads use the address space that exec
+  // would replace, even if they have exited.
+  if(p->mm->ref > 1)
+    return -1;
+
+  memset(vma, 0, sizeof(vma));
+  v = vma;
 
   begin_op();
 
@@ -38,7 +49,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program's segments. Nothing is read yet:
+  // vmfault() reads each page from ip when it is first
+  // touched, through the page cache.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,21 +61,33 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz > USERTOP)
       goto bad;
-    sz = sz1;
     if((ph.vaddr % PGSIZE) != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off)
       goto bad;
+    if(ph.memsz == 0)
+      continue;
+    if(v == &vma[NVMA])
+      goto bad;
+    v->va = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v->perm = perm(ph.flags);
+    v->flags = MAP_PRIVATE;
+    v++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = p->mm->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
@@ -107,14 +132,29 @@ exec(char *path, char **argv)
     if(*s == '/')
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
+
+  // Drop the old image's regions, writing back
+  // shared mappings while the old page table is
+  // still in place.
+  vmafree(p);
     
   // Commit to the user image.
   oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
+  if(p->slot != 0){
+    // a thread whose siblings have all exited: its
+    // trapframe moves to slot 0 of the new page table,
+    // and must not be freed with the old one.
+    uvmunmap(oldpagetable, UTRAPFRAME(p->slot), 1, 0);
+  }
+  p->pagetable = p->mm->pagetable = pagetable;
+  p->slot = 0;
+  p->mm->slots = 1;
+  p->mm->asidgen = 0;
+  p->mm->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  memmove(p->mm->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -122,33 +162,28 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
-    end_op();
+    iunlock(ip);
+  } else {
+    begin_op();
   }
+  for(v = vma; v < &vma[NVMA]; v++)
+    if(v->ip)
+      iput(v->ip);
+  if(ip)
+    iput(ip);
+  end_op();
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
+// Convert ELF segment flags to PTE permissions.
 static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+perm(int flags)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+  int perm = PTE_R;
+
+  if(flags & ELF_PROG_FLAG_WRITE)
+    perm |= PTE_W;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    perm |= PTE_X;
+  return perm;
 }
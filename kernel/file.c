@@ -12,17 +12,24 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "uio.h"
+#include "poll.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from a slab cache, so there
+// is no fixed limit on open files system-wide.
+// ftable.lock protects every file's ref count.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +38,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +74,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,26 +104,74 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
+// Which of events are ready on file f, for poll().
+// e, if not 0, goes on the waitq of f's pipe or device,
+// to be woken when that changes. Inodes never block.
 int
-fileread(struct file *f, uint64 addr, int n)
+filepoll(struct file *f, int events, struct pollent *e)
 {
-  int r = 0;
+  if(f->readable == 0)
+    events &= ~POLLIN;
+  if(f->writable == 0)
+    events &= ~POLLOUT;
+
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, f->writable, events, e);
+  if(f->type == FD_DEVICE){
+    if(f->major < 0 || f->major >= NDEV)
+      return POLLNVAL;
+    if(devsw[f->major].poll)
+      return devsw[f->major].poll(events, e);
+  }
+  return events & (POLLIN|POLLOUT);
+}
+
+// Read from file f into the n buffers of iov, at
+// offset off, or at and after f->off if off is -1.
+// The buffers are user virtual addresses. A pipe or
+// device has no offset, and fills only the first buffer
+// that is not empty, so as not to wait for more once it
+// has returned something.
+int
+filereadv(struct file *f, struct iovec *iov, int n, int off)
+{
+  int i, r = 0;
+  uint o;
 
   if(f->readable == 0)
     return -1;
 
-  if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
+  if(f->type == FD_PIPE || f->type == FD_DEVICE){
+    if(off != -1)
+      return -1;
+    for(i = 0; i < n && iov[i].iov_len == 0; i++)
+      ;
+    if(i == n)
+      return 0;
+    if(f->type == FD_PIPE)
+      return piperead(f->pipe, (uint64)iov[i].iov_base, iov[i].iov_len);
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    return devsw[f->major].read(1, (uint64)iov[i].iov_base, iov[i].iov_len);
   } else if(f->type == FD_INODE){
+    // one ilock, so that the buffers are filled from
+    // one consistent stretch of the file.
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    o = off == -1 ? f->off : off;
+    for(i = 0; i < n; i++){
+      int r1 = readi(f->ip, 1, (uint64)iov[i].iov_base, o, iov[i].iov_len);
+      if(r1 < 0){
+        if(r == 0)
+          r = -1;
+        break;
+      }
+      o += r1;
+      r += r1;
+      if(r1 < iov[i].iov_len)
+        break;
+    }
+    if(off == -1)
+      f->off = o;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -129,50 +180,96 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
-// Write to file f.
+// Read from file f.
 // addr is a user virtual address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+fileread(struct file *f, uint64 addr, int n)
+{
+  struct iovec iov = { (void*)addr, n };
+
+  return filereadv(f, &iov, 1, -1);
+}
+
+// Write to file f from the n buffers of iov, at offset
+// off, or at and after f->off if off is -1. The buffers
+// are user virtual addresses. Returns the number of bytes
+// written, or -1 if not all of them were.
+int
+filewritev(struct file *f, struct iovec *iov, int n, int off)
 {
-  int r, ret = 0;
+  int i, r, want = 0, ret = 0;
+  uint o;
 
   if(f->writable == 0)
     return -1;
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+  for(i = 0; i < n; i++)
+    want += iov[i].iov_len;
+
+  if(f->type == FD_PIPE || f->type == FD_DEVICE){
+    if(off != -1)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    if(f->type == FD_DEVICE &&
+       (f->major < 0 || f->major >= NDEV || !devsw[f->major].write))
+      return -1;
+    for(i = 0; i < n; i++){
+      if(f->type == FD_PIPE)
+        r = pipewrite(f->pipe, (uint64)iov[i].iov_base, iov[i].iov_len);
+      else
+        r = devsw[f->major].write(1, (uint64)iov[i].iov_base, iov[i].iov_len);
+      if(r < 0)
+        return ret ? ret : -1;
+      ret += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
+    // the buffers go to consecutive bytes of the file,
+    // so one transaction takes as many of them as fit.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
+    int done = 0;  // bytes of iov[i] written
+    i = 0;
+    o = off == -1 ? f->off : off;
+    while(ret < want){
+      int room = max;
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      if(off == -1)
+        o = f->off;
+      for(r = 0; i < n && room > 0; room -= r){
+        int n1 = iov[i].iov_len - done;
+        if(n1 > room)
+          n1 = room;
+        if((r = writei(f->ip, 1, (uint64)iov[i].iov_base + done, o, n1)) > 0){
+          o += r;
+          ret += r;
+          done += r;
+        }
+        if(r != n1)
+          break;
+        if(done == iov[i].iov_len){
+          i++;
+          done = 0;
+        }
+      }
+      if(off == -1)
+        f->off = o;
       iunlock(f->ip);
       end_op();
 
-      if(r != n1){
+      if(room > 0 && i < n){
         // error from writei
         break;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    ret = (ret == want ? want : -1);
   } else {
     panic("filewrite");
   }
@@ -180,3 +277,82 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  struct iovec iov = { (void*)addr, n };
+
+  return filewritev(f, &iov, 1, -1);
+}
+
+// Move up to n bytes from file in to file out inside the
+// kernel, one of them an inode and the other a pipe.
+// From an inode, the data goes into the pipe straight
+// from the buffer cache; from a pipe, it goes through a
+// kernel page, a block at a time, into writei(). Either
+// way it never passes through user memory. Returns the
+// number of bytes moved, which is less than n only at the
+// end of the input or on an error after some were moved,
+// or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int r, tot = 0;
+  char *buf;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if(in->type == FD_INODE && out->type == FD_PIPE){
+    while(tot < n){
+      // wait without the inode locked, so that others
+      // can use the file while the pipe drains.
+      if(pipewait(out->pipe) < 0)
+        return tot > 0 ? tot : -1;
+      ilock(in->ip);
+      if(in->off >= in->ip->size){
+        iunlock(in->ip);
+        break;
+      }
+      // 0 if another writer filled the pipe first.
+      if((r = readipipe(in->ip, out->pipe, in->off, n - tot)) > 0)
+        in->off += r;
+      iunlock(in->ip);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+    }
+  } else if(in->type == FD_PIPE && out->type == FD_INODE){
+    if((buf = kalloc()) == 0)
+      return -1;
+    while(tot < n){
+      int m = n - tot < BSIZE ? n - tot : BSIZE;
+      if((m = pipeget(in->pipe, buf, m)) <= 0){
+        if(m < 0 && tot == 0)
+          tot = -1;
+        break;
+      }
+      begin_op();
+      ilock(out->ip);
+      if((r = writei(out->ip, 0, (uint64)buf, out->off, m)) > 0){
+        out->off += r;
+        tot += r;
+      }
+      iunlock(out->ip);
+      end_op();
+      if(r != m){
+        // the file is full, or the disk is; the rest of
+        // buf has left the pipe and is dropped.
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+    }
+    kfree(buf);
+  } else {
+    return -1;
+  }
+  return tot;
+}
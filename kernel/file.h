@@ -18,8 +18,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int pcached;        // may have pages in the page cache
 
   short type;         // copy of disk inode
   short major;
@@ -29,12 +31,36 @@ struct inode {
   uint addrs[NDIRECT+1];
 };
 
+// processes in poll() waiting for a pipe or device to change.
+// protected by the lock of the pipe or device.
+struct waitq {
+  struct pollent *head;
+};
+
+// one descriptor of a poll(), on the waitq of its pipe or
+// device. lives on the poller's kernel stack.
+struct pollent {
+  struct poller *pl;
+  struct waitq *q;      // 0 until added by pollwait()
+  struct spinlock *lk;  // q's lock
+  struct pollent *next;
+  struct pollent **prev;
+};
+
+// a process in poll(). ready is set, under polllock, when
+// one of its waitqs is woken.
+struct poller {
+  int ready;
+};
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(int, struct pollent*);  // 0 if never blocks
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
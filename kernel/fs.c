@@ -15,8 +15,8 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -167,37 +167,107 @@ bfree(int dev, uint b)
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
+// The table is a list of inodes allocated from a slab cache.
+// It grows when every entry is referenced, and iput() frees
+// unreferenced entries while the table holds more than NINODE.
+// ireclaim() frees all unreferenced entries when memory runs low.
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *list;
+  int n;                    // entries on list
+  struct kmem_cache *cache;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+}
+
+static struct inode*
+inodealloc(void)
+{
+  struct inode *ip;
+
+  if((ip = kmem_cache_alloc(itable.cache)) == 0)
+    return 0;
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
+  return ip;
+}
+
+static void
+inodefree(struct inode *ip)
+{
+  freelock(&ip->lock.lk);
+  kmem_cache_free(itable.cache, ip);
+}
+
+// Take ip off the table. Caller holds itable.lock.
+static void
+iunlink(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.list; *pp; pp = &(*pp)->next){
+    if(*pp == ip){
+      *pp = ip->next;
+      itable.n--;
+      return;
+    }
   }
+  panic("iunlink");
+}
+
+// Free every unreferenced inode in the table.
+// Called when kalloc() runs dry.
+// Returns the number of inodes freed.
+int
+ireclaim(void)
+{
+  struct inode **pp, *ip, *freed = 0;
+  int n = 0;
+
+  acquire(&itable.lock);
+  for(pp = &itable.list; (ip = *pp) != 0; ){
+    if(ip->ref == 0){
+      *pp = ip->next;
+      itable.n--;
+      ip->next = freed;
+      freed = ip;
+    } else {
+      pp = &ip->next;
+    }
+  }
+  release(&itable.lock);
+
+  while((ip = freed) != 0){
+    freed = ip->next;
+    inodefree(ip);
+    n++;
+  }
+  return n;
 }
 
 static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there is no memory for it.
 struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
@@ -207,7 +277,15 @@ ialloc(uint dev, short type)
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      if((ip = iget(dev, inum)) == 0){
+        // give it back on the disk.
+        bp = bread(dev, IBLOCK(inum, sb));
+        dip = (struct dinode*)bp->data + inum%IPB;
+        dip->type = 0;
+        log_write(bp);
+        brelse(bp);
+      }
+      return ip;
     }
     brelse(bp);
   }
@@ -239,29 +317,51 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if the table is full and there is no
+// memory to grow it.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *empty, *fresh;
 
+  fresh = 0;
   acquire(&itable.lock);
 
+again:
   // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
+  for(ip = itable.list; ip; ip = ip->next){
     if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
+      if(fresh)
+        inodefree(fresh);
       return ip;
     }
     if(empty == 0 && ip->ref == 0)    // Remember empty slot.
       empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  if(empty == 0){
+    if(fresh == 0){
+      // Every entry is in use: grow the table. kalloc() may
+      // call ireclaim(), so allocate without itable.lock and
+      // then look again, since another process may have
+      // added this inode meanwhile.
+      release(&itable.lock);
+      if((fresh = inodealloc()) == 0)
+        return 0;
+      acquire(&itable.lock);
+      goto again;
+    }
+    fresh->next = itable.list;
+    itable.list = fresh;
+    itable.n++;
+    empty = fresh;
+    fresh = 0;
+  }
 
+  // Recycle an inode entry.
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
@@ -269,6 +369,8 @@ iget(uint dev, uint inum)
   ip->valid = 0;
   release(&itable.lock);
 
+  if(fresh)
+    inodefree(fresh);
   return ip;
 }
 
@@ -307,6 +409,9 @@ ilock(struct inode *ip)
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
+    // pages cached by an earlier in-memory copy of
+    // this inode may still be there.
+    ip->pcached = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -324,7 +429,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, or freed if the table is larger than NINODE.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -354,6 +459,13 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0 && itable.n > NINODE){
+    // the table grew past its usual size; shrink it back.
+    iunlink(ip);
+    release(&itable.lock);
+    inodefree(ip);
+    return;
+  }
   release(&itable.lock);
 }
 
@@ -413,6 +525,7 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_invalidate(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -476,6 +589,36 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Read data from inode straight from the buffer cache
+// into pipe pi, as much of it as the pipe has room for.
+// Caller must hold ip->lock.
+// Returns the number of bytes copied, or -1 if the read
+// side of the pipe is closed.
+int
+readipipe(struct inode *ip, struct pipe *pi, uint off, uint n)
+{
+  uint tot;
+  int m, r;
+  struct buf *bp;
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0; tot<n; tot+=r, off+=r){
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    m = min(n - tot, BSIZE - off%BSIZE);
+    r = pipeput(pi, (char*)bp->data + (off % BSIZE), m);
+    brelse(bp);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    if(r < m)
+      return tot + r;
+  }
+  return tot;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -501,6 +644,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcache_write(ip, off, bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -525,11 +669,12 @@ namecmp(const char *s, const char *t)
 }
 
 // Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// If found, set *poff to byte offset of entry and
+// return its inode number; otherwise return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
   struct dirent de;
 
   if(dp->type != T_DIR)
@@ -544,27 +689,37 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if not found, or if there is no memory
+// for the entry's inode.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum;
+
+  if((inum = dirfind(dp, name, poff)) == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
-  struct inode *ip;
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(dp, name, 0) != 0)
     return -1;
-  }
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
@@ -634,6 +789,8 @@ namex(char *path, int nameiparent, char *name)
     ip = iget(ROOTDEV, ROOTINO);
   else
     ip = idup(myproc()->cwd);
+  if(ip == 0)
+    return 0;
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -0,0 +1,140 @@
+//
+// Futexes: futex_wait() puts a process to sleep until
+// another calls futex_wake() on the same user word. A word
+// is known by its physical address, so the threads of a
+// process share futexes, and so do processes that share
+// the memory through a MAP_SHARED mapping.
+//
+// A word in a copy-on-write page gets a private copy of the
+// page first, as a store would. The page stays pinned while
+// a process waits on it, but a fork() can still make it
+// copy-on-write again, and the next store then moves the
+// word to a new page; cowfault() calls futexmoved() to wake
+// the waiters on the old one, which look at the word again.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+// futex_wait() looks at the word and goes to sleep with its
+// bucket's lock held, and futex_wake() wakes with it held,
+// so a wakeup can't come in between.
+#define NFUTEX 31
+
+struct spinlock futexlock[NFUTEX];
+
+// the number of processes in futex_wait(), so that
+// futexmoved() costs nothing when there are none, and the
+// number of futexmoved() calls that woke waiters.
+static int nwaiting;
+static int nmoved;
+
+static struct spinlock *
+futexbucket(uint64 pa)
+{
+  return &futexlock[(pa / sizeof(int)) % NFUTEX];
+}
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
+}
+
+// Return the physical address of the word at user address
+// addr, with its page pinned, or 0.
+static uint64
+futexaddr(uint64 addr)
+{
+  uint64 pa;
+
+  if((addr % sizeof(int)) != 0)
+    return 0;
+  if((pa = uvmpin(myproc()->pagetable, PGROUNDDOWN(addr), 1, 1)) == 0)
+    return 0;
+  return pa + (addr % PGSIZE);
+}
+
+// If the word at user address addr holds val, sleep until
+// a futex_wake() on it, or until killed.
+// Returns 0 after sleeping, -1 if the word held some other
+// value or addr is not a writable, aligned user address.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk;
+  uint64 pa;
+  int moved, r = -1;
+
+  __atomic_fetch_add(&nwaiting, 1, __ATOMIC_SEQ_CST);
+  moved = __atomic_load_n(&nmoved, __ATOMIC_SEQ_CST);
+  if((pa = futexaddr(addr)) == 0){
+    __atomic_fetch_sub(&nwaiting, 1, __ATOMIC_SEQ_CST);
+    return -1;
+  }
+  lk = futexbucket(pa);
+  acquire(lk);
+  if(nmoved != moved){
+    // the word may have moved since futexaddr(); let the
+    // caller look again.
+    r = 0;
+  } else if(__atomic_load_n((int*)pa, __ATOMIC_SEQ_CST) == val && !p->killed){
+    sleep((void*)pa, lk);
+    r = 0;
+  }
+  release(lk);
+  kfree((void*)PGROUNDDOWN(pa));
+  __atomic_fetch_sub(&nwaiting, 1, __ATOMIC_SEQ_CST);
+  return r;
+}
+
+// Wake up to n processes waiting on the word at user
+// address addr. Returns the number woken, or -1 if addr
+// is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int r;
+
+  if(n <= 0)
+    return 0;
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  lk = futexbucket(pa);
+  acquire(lk);
+  r = wakeupn((void*)pa, n);
+  release(lk);
+  kfree((void*)PGROUNDDOWN(pa));
+  return r;
+}
+
+// cowfault() gave some page table a copy of the page at pa,
+// so futex words in it now live somewhere else. Wake every
+// process waiting on a word of the old page; a futex_wake()
+// on the new page would miss them. Holding every bucket's
+// lock keeps a futex_wait() that has found pa but not yet
+// slept from missing this.
+void
+futexmoved(uint64 pa)
+{
+  int i;
+
+  if(__atomic_load_n(&nwaiting, __ATOMIC_SEQ_CST) == 0)
+    return;
+  for(i = 0; i < NFUTEX; i++)
+    acquire(&futexlock[i]);
+  nmoved++;
+  wakeuprange((void*)pa, (void*)(pa + PGSIZE));
+  for(i = 0; i < NFUTEX; i++)
+    release(&futexlock[i]);
+}
@@ -1,6 +1,30 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// Free memory lives in a binary buddy system: a block
+// of order k is 2^k pages aligned on a 2^k page boundary,
+// and freeing a block merges it with its buddy whenever
+// the buddy is free too.
+//
+// Each hart also keeps its own freelist of single pages,
+// so the common kalloc()/kfree() path only touches a lock
+// that no other hart normally wants. Pages move between
+// the harts and the buddy system KMEM_BATCH at a time; a
+// hart whose list and the buddy system are both empty
+// steals from the other harts.
+//
+// When a hart has nothing to run, its scheduler loop zeroes
+// free pages ahead of time for kalloc_zeroed(), so that page
+// tables and fresh user memory need not be cleared while a
+// process waits. Building with KALLOCDEBUG=1 fills pages
+// with junk on kalloc() and kfree() to catch dangling refs.
+//
+// Every page handed out by kalloc() has a reference count,
+// so that copy-on-write fork can share a page between page
+// tables: kref() adds a reference, and kfree() only frees
+// the page when the last one is dropped.
 
 #include "types.h"
 #include "param.h"
@@ -14,19 +38,127 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KMEM_BATCHORDER 5
+#define KMEM_BATCH (1<<KMEM_BATCHORDER) // pages moved to/from the buddy system at once
+#define KMEM_HIGH  (2*KMEM_BATCH)   // per-hart length that triggers a flush
+#define KMEM_ZERO  KMEM_BATCH       // pre-zeroed pages each hart keeps ready
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PFN(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PFN2PA(pfn) ((uint64)(pfn) * PGSIZE + KERNBASE)
+
 struct run {
   struct run *next;
+  struct run *prev;      // buddy free lists only
 };
 
-struct {
+// per-hart freelist.
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+  struct run *zlist;  // pages already zeroed
+  int nzero;
+
+  // statistics, protected by lock.
+  uint nalloc;
+  uint nrefill;   // batches taken from the buddy system
+  uint nflush;    // batches given back to the buddy system
+  uint nsteal;    // pages stolen from other harts
+  uint nzhit;     // kalloc_zeroed() calls served from zlist
+  uint nzmiss;    // ... that had to zero a page
+};
+
+struct kmem kmem[NCPU];
+
+// reference counts of pages returned by kalloc(),
+// updated with atomic instructions.
+int pageref[NPAGE];
+
+// the buddy system.
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1]; // circular list heads, one per order
+  int nfree[MAXORDER+1];       // number of free blocks of each order
+  uchar order[NPAGE];          // k+1 if the page heads a free block of order k
+} buddy;
+
+static void
+buddy_push(uint64 pfn, int k)
+{
+  struct run *r = (struct run*)PFN2PA(pfn);
+  struct run *head = &buddy.free[k];
+
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+  buddy.order[pfn] = k + 1;
+  buddy.nfree[k]++;
+}
+
+static void
+buddy_remove(uint64 pfn, int k)
+{
+  struct run *r = (struct run*)PFN2PA(pfn);
+
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  buddy.order[pfn] = 0;
+  buddy.nfree[k]--;
+}
+
+// Return the block of order k at pfn to the buddy system,
+// merging it with free buddies. Caller holds buddy.lock.
+static void
+buddy_free(uint64 pfn, int k)
+{
+  while(k < MAXORDER){
+    uint64 bpfn = pfn ^ (1L << k);
+    if(bpfn >= NPAGE || buddy.order[bpfn] != k + 1)
+      break;
+    buddy_remove(bpfn, k);
+    if(bpfn < pfn)
+      pfn = bpfn;
+    k++;
+  }
+  buddy_push(pfn, k);
+}
+
+// Take a block of order k out of the buddy system,
+// splitting a larger block if need be.
+// Caller holds buddy.lock. Returns 0 if there is none.
+static void *
+buddy_alloc(int k)
+{
+  struct run *r;
+  uint64 pfn;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(buddy.nfree[j] > 0)
+      break;
+  if(j > MAXORDER)
+    return 0;
+
+  r = buddy.free[j].next;
+  pfn = PA2PFN(r);
+  buddy_remove(pfn, j);
+  while(j > k){
+    j--;
+    buddy_push(pfn + (1L << j), j);
+  }
+  return (void*)r;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,8 +167,132 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&buddy.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddy_free(PA2PFN(p), 0);
+  release(&buddy.lock);
+}
+
+// Move KMEM_BATCH pages from the front of km's list
+// to the buddy system. Caller holds km->lock.
+static void
+kflush(struct kmem *km)
+{
+  struct run *r;
+  int i;
+
+  acquire(&buddy.lock);
+  for(i = 0; i < KMEM_BATCH; i++){
+    r = km->freelist;
+    km->freelist = r->next;
+    buddy_free(PA2PFN(r), 0);
+  }
+  release(&buddy.lock);
+  km->nfree -= KMEM_BATCH;
+  km->nflush++;
+}
+
+// Fill km's empty list with up to KMEM_BATCH pages,
+// preferably one contiguous block, from the buddy system.
+// Caller holds km->lock.
+static void
+krefill(struct kmem *km)
+{
+  char *b;
+  int n = 0;
+
+  acquire(&buddy.lock);
+  if((b = buddy_alloc(KMEM_BATCHORDER)) != 0){
+    for(n = 0; n < KMEM_BATCH; n++){
+      struct run *r = (struct run*)(b + n*PGSIZE);
+      r->next = km->freelist;
+      km->freelist = r;
+    }
+  } else {
+    for(; n < KMEM_BATCH && (b = buddy_alloc(0)) != 0; n++){
+      struct run *r = (struct run*)b;
+      r->next = km->freelist;
+      km->freelist = r;
+    }
+  }
+  release(&buddy.lock);
+
+  km->nfree += n;
+  if(n > 0)
+    km->nrefill++;
+}
+
+// Give every page on every hart's lists back to the buddy
+// system, so that freed pages can merge into larger blocks.
+// Returns the number of pages moved.
+static int
+kdrain(void)
+{
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    acquire(&km->lock);
+    acquire(&buddy.lock);
+    while(km->freelist){
+      struct run *r = km->freelist;
+      km->freelist = r->next;
+      buddy_free(PA2PFN(r), 0);
+    }
+    while(km->zlist){
+      struct run *r = km->zlist;
+      km->zlist = r->next;
+      buddy_free(PA2PFN(r), 0);
+    }
+    n += km->nfree + km->nzero;
+    km->nfree = 0;
+    km->nzero = 0;
+    release(&buddy.lock);
+    release(&km->lock);
+  }
+  return n;
+}
+
+// Steal half of some other hart's pages onto
+// hart id's list. Called without any kmem lock held.
+// Returns one of the pages, or 0.
+static struct run *
+ksteal(int id)
+{
+  struct run *r, *first, *last;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+    if(victim->nfree == 0)
+      continue;
+
+    acquire(&victim->lock);
+    n = (victim->nfree + 1) / 2;
+    first = last = victim->freelist;
+    if(first == 0){
+      release(&victim->lock);
+      continue;
+    }
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    victim->freelist = last->next;
+    victim->nfree -= n;
+    release(&victim->lock);
+
+    // keep the first page, give the rest to this hart.
+    r = first;
+    acquire(&kmem[id].lock);
+    if(n > 1){
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = first->next;
+      kmem[id].nfree += n - 1;
+    }
+    kmem[id].nsteal += n;
+    release(&kmem[id].lock);
+    return r;
+  }
+  return 0;
 }
 
 // Free the page of physical memory pointed at by v,
@@ -47,19 +303,50 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  int ref = __sync_sub_and_fetch(&pageref[PA2PFN(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  if(km->nfree >= KMEM_HIGH)
+    kflush(km);
+  release(&km->lock);
+  pop_off();
+}
+
+// Out of pages: ask the kernel's caches to give back
+// memory they are holding on to but not using.
+// Returns the number of pages (or objects) released.
+static int
+kreclaim(void)
+{
+  int n = 0;
+
+  n += pcache_evict();
+  n += ireclaim();
+  n += procreclaim();
+  n += kmem_cache_reap();
+  n += kdrain();     // including the zeroed pages
+  return n;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +356,249 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  km = &kmem[id];
+  acquire(&km->lock);
+  if(km->freelist == 0)
+    krefill(km);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+    km->nalloc++;
+  } else if((r = km->zlist) != 0){
+    km->zlist = r->next;
+    km->nzero--;
+    km->nalloc++;
+  }
+  release(&km->lock);
+
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
 
+  if(r == 0 && kreclaim() > 0)
+    return kalloc();
+
+  if(r)
+    pageref[PA2PFN(r)] = 1;
+#ifdef KALLOC_DEBUG
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one page of physical memory filled with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r = km->zlist;
+  if(r){
+    km->zlist = r->next;
+    km->nzero--;
+    km->nalloc++;
+    km->nzhit++;
+  } else {
+    km->nzmiss++;
+  }
+  release(&km->lock);
+  pop_off();
+
+  if(r){
+    r->next = 0;  // the only non-zero word
+    pageref[PA2PFN(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Called by the scheduler when this hart has nothing to run:
+// zero one free page and add it to the hart's zlist.
+// Returns 0 if the zlist is already full or there is
+// no free page to zero.
+int
+kzero(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  if(km->nzero >= KMEM_ZERO){
+    release(&km->lock);
+    pop_off();
+    return 0;
+  }
+  if(km->freelist == 0)
+    krefill(km);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  pop_off();
+  if(r == 0)
+    return 0;
+
+  // zero the page with interrupts on and no locks held,
+  // so that a process becoming runnable is not delayed.
+  memset((char*)r, 0, PGSIZE);
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->zlist;
+  km->zlist = r;
+  km->nzero++;
+  release(&km->lock);
+  pop_off();
+  return 1;
+}
+
+// Add a reference to a page returned by kalloc().
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&pageref[PA2PFN(pa)], 1) < 1)
+    panic("kref: free page");
+}
+
+// Return the number of references to a page
+// returned by kalloc().
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&pageref[PA2PFN(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// on a 2^order page boundary. kalloc() is the fast path
+// for order 0. Returns 0 if no large enough block is free.
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  pa = buddy_alloc(order);
+  release(&buddy.lock);
+  if(pa == 0){
+    // pages parked on the per-hart lists may be
+    // keeping a block from forming.
+    kdrain();
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+
+  if(pa == 0)
+    return 0;
+  // each page gets its own reference, so that the
+  // block may also be freed a page at a time with kfree().
+  for(int i = 0; i < (1 << order); i++)
+    pageref[PA2PFN(pa) + i] = 1;
+#ifdef KALLOC_DEBUG
+  memset(pa, 5, PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  for(int i = 0; i < (1 << order); i++)
+    pageref[PA2PFN(pa) + i] = 0;
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  buddy_free(PA2PFN(pa), order);
+  release(&buddy.lock);
+}
+
+static int buddystats(char*, int);
+
+// Describe the allocator's state for the statistics device.
+int
+kallocstats(char *buf, int sz)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "--- kalloc\n");
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    if(km->nalloc == 0 && km->nfree == 0 && km->nzero == 0)
+      continue;
+    n += snprintf(buf+n, sz-n,
+                  "hart %d: free %d alloc %d refill %d flush %d steal %d\n",
+                  i, km->nfree, km->nalloc, km->nrefill, km->nflush, km->nsteal);
+    n += snprintf(buf+n, sz-n,
+                  "hart %d: zeroed %d kalloc_zeroed hit %d miss %d\n",
+                  i, km->nzero, km->nzhit, km->nzmiss);
+  }
+  n += snprint_lock(buf+n, sz-n, &buddy.lock);
+  n += buddystats(buf+n, sz-n);
+  return n;
+}
+
+// Report free blocks per order. The fragmentation figure
+// is the percentage of free pages that sit in blocks too
+// small to back a 2-megabyte (order 9) allocation.
+static int
+buddystats(char *buf, int sz)
+{
+  int n = 0, k;
+  int nfree[MAXORDER+1];
+  int total = 0, small = 0;
+
+  acquire(&buddy.lock);
+  for(k = 0; k <= MAXORDER; k++)
+    nfree[k] = buddy.nfree[k];
+  release(&buddy.lock);
+
+  n += snprintf(buf+n, sz-n, "--- buddy free blocks by order:");
+  for(k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, " %d", nfree[k]);
+    total += nfree[k] << k;
+    if(k < 9)
+      small += nfree[k] << k;
+  }
+  n += snprintf(buf+n, sz-n, "\nfree pages %d, fragmentation %d%%\n",
+                total, total ? small * 100 / total : 0);
+  return n;
+}
@@ -19,6 +19,7 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    slabinit();      // small-object caches
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -27,6 +28,12 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    pcacheinit();    // mapped file page cache
+    futexinit();     // futex wait queues
+    theapinit();     // sleep_ns() timer heaps
+    pollinit();      // poll() lock
+    statsinit();     // statistics device
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -25,8 +25,10 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
-// core local interruptor (CLINT), which contains the timer.
+// core local interruptor (CLINT), which contains the timer
+// and the machine-mode software interrupt (IPI) bits.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -53,6 +55,8 @@
 
 // map kernel stacks beneath the trampoline,
 // each surrounded by invalid guard pages.
+// slot p is used by the p'th process structure
+// allocated; see allocproc().
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
 // User memory layout.
@@ -62,6 +66,23 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   USYSCALL (read-only, shared with the kernel)
+//   trapframes of the other threads; see clone()
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// each thread of an address space has its own trapframe
+// page, that of thread slot t at UTRAPFRAME(t). the first
+// thread's is at TRAPFRAME. user memory lies below USERTOP.
+#define UTRAPFRAME(t) (TRAPFRAME - (t)*PGSIZE)
+#define USYSCALL (UTRAPFRAME(NTHREAD-1) - PGSIZE)
+#define USERTOP USYSCALL
+
+// the page at USYSCALL, from which ulib.c answers some
+// system calls without trapping into the kernel.
+struct usyscall {
+  int pid;            // pid of the address space's first thread
+  uint64 tickcycles;  // time CSR cycles per uptime() tick
+  uint64 nspercycle;  // nanoseconds per time CSR cycle
+};
@@ -1,13 +1,17 @@
-#define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NOFILE       64  // open files per process
+#define NVMA         16  // file-backed memory regions per process
+#define NTHREAD      16  // threads sharing an address space
+#define NINODE       50  // unreferenced in-memory i-nodes kept for reuse
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest kalloc_pages() block is 2^MAXORDER pages
+#define TIMEBASE     10000000  // timer cycles per second in qemu
+#define NSPERCYCLE   (1000000000 / TIMEBASE)  // nanoseconds per timer cycle
+#define TICKCYCLES   (TIMEBASE / 10)  // timer cycles per clock tick
@@ -0,0 +1,274 @@
+// Page cache for file pages mapped into user memory.
+//
+// exec() does not read a program into memory; vmfault()
+// fills each page of a program segment, or of an mmap()ed
+// file, when it is first touched, using pcache_get(). The
+// cache keeps the page it read, so that other processes
+// running the same program map the same physical page
+// instead of reading it again. Private writable mappings
+// map cached pages copy-on-write; MAP_SHARED ones map
+// them writable.
+//
+// A cached page is identified by the inode and by the range
+// of file bytes it holds: off is the file offset of the
+// page's first byte and n (at most PGSIZE) the number of
+// bytes read from the file; the rest of the page is zero.
+//
+// writei() copies what it writes into the cached pages
+// with pcache_write(), so that write() and MAP_SHARED
+// mappings of a file see the same bytes. itrunc() calls
+// pcache_invalidate(), and processes that already map the
+// old pages keep them. kalloc() calls pcache_evict() when
+// memory runs out.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCHASH 61
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;
+  uint n;
+  char *pa;              // holds one reference to the page
+  struct cpage *next;    // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCHASH];  // hashed on dev and inum
+  int n;                        // pages cached
+  struct kmem_cache *cache;
+
+  // statistics, protected by lock.
+  uint nhit;
+  uint nmiss;
+  uint nevict;
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = kmem_cache_create("cpage", sizeof(struct cpage));
+}
+
+static struct cpage **
+pcache_bucket(uint dev, uint inum)
+{
+  return &pcache.hash[(dev * 31 + inum) % NPCHASH];
+}
+
+// Find a cached page. Caller holds pcache.lock.
+static struct cpage *
+pcache_lookup(uint dev, uint inum, uint off, uint n)
+{
+  struct cpage *c;
+
+  for(c = *pcache_bucket(dev, inum); c; c = c->next)
+    if(c->dev == dev && c->inum == inum && c->off == off && c->n == n)
+      return c;
+  return 0;
+}
+
+// Return a page holding n bytes of ip's content from
+// offset off, followed by zeros, with a reference for
+// the caller. ip must not be locked by the caller; may
+// sleep. Returns 0 if out of memory or the read fails.
+char *
+pcache_get(struct inode *ip, uint off, uint n)
+{
+  struct cpage *c, *nc;
+  char *pa;
+
+  acquire(&pcache.lock);
+  if((c = pcache_lookup(ip->dev, ip->inum, off, n)) != 0){
+    pa = c->pa;
+    kref(pa);
+    pcache.nhit++;
+    release(&pcache.lock);
+    return pa;
+  }
+  pcache.nmiss++;
+  release(&pcache.lock);
+
+  if((pa = kalloc_zeroed()) == 0)
+    return 0;
+  nc = kmem_cache_alloc(pcache.cache);
+
+  // read under the inode lock, and add the page to the
+  // cache before unlocking, so that a concurrent writei()
+  // either happens first or updates this page.
+  ilock(ip);
+  if(readi(ip, 0, (uint64)pa, off, n) != n){
+    iunlock(ip);
+    kfree(pa);
+    if(nc)
+      kmem_cache_free(pcache.cache, nc);
+    return 0;
+  }
+  acquire(&pcache.lock);
+  if((c = pcache_lookup(ip->dev, ip->inum, off, n)) != 0){
+    // another process read it meanwhile.
+    kref(c->pa);
+    release(&pcache.lock);
+    iunlock(ip);
+    kfree(pa);
+    pa = c->pa;
+  } else if(nc){
+    ip->pcached = 1;
+    nc->dev = ip->dev;
+    nc->inum = ip->inum;
+    nc->off = off;
+    nc->n = n;
+    nc->pa = pa;
+    kref(pa);
+    nc->next = *pcache_bucket(ip->dev, ip->inum);
+    *pcache_bucket(ip->dev, ip->inum) = nc;
+    pcache.n++;
+    nc = 0;
+    release(&pcache.lock);
+    iunlock(ip);
+  } else {
+    // no memory for a cache entry; the page is just
+    // the caller's.
+    release(&pcache.lock);
+    iunlock(ip);
+  }
+  if(nc)
+    kmem_cache_free(pcache.cache, nc);
+  return pa;
+}
+
+// Unlink and return the entries of one hash bucket that
+// belong to dev and inum, or all of them if all is set.
+// Caller holds pcache.lock.
+static struct cpage *
+pcache_unlink(struct cpage **pp, uint dev, uint inum, int all)
+{
+  struct cpage *c, *gone = 0;
+
+  while((c = *pp) != 0){
+    if(all || (c->dev == dev && c->inum == inum)){
+      *pp = c->next;
+      c->next = gone;
+      gone = c;
+      pcache.n--;
+    } else {
+      pp = &c->next;
+    }
+  }
+  return gone;
+}
+
+// Drop the cache's references to a list of unlinked entries.
+// Returns the number dropped.
+static int
+pcache_drop(struct cpage *c)
+{
+  struct cpage *next;
+  int n = 0;
+
+  for(; c; c = next){
+    next = c->next;
+    kfree(c->pa);
+    kmem_cache_free(pcache.cache, c);
+    n++;
+  }
+  return n;
+}
+
+// Copy n bytes at src, just written to ip at offset off,
+// into the cached pages that hold those bytes of the file.
+// If the file has no cached pages at all, clear
+// ip->pcached, so that later writes skip pcache.lock.
+// Caller must hold ip->lock, under which pages are added.
+void
+pcache_write(struct inode *ip, uint off, void *src, uint n)
+{
+  struct cpage *c;
+  uint s, e;
+  int found = 0;
+
+  if(ip->pcached == 0)
+    return;
+  acquire(&pcache.lock);
+  for(c = *pcache_bucket(ip->dev, ip->inum); c; c = c->next){
+    if(c->dev != ip->dev || c->inum != ip->inum)
+      continue;
+    found = 1;
+    s = off > c->off ? off : c->off;
+    e = off + n < c->off + c->n ? off + n : c->off + c->n;
+    if(s < e)
+      memmove(c->pa + (s - c->off), (char*)src + (s - off), e - s);
+  }
+  if(!found)
+    ip->pcached = 0;
+  release(&pcache.lock);
+}
+
+// Forget every cached page of an inode whose
+// content is about to change.
+// Caller must hold ip->lock.
+void
+pcache_invalidate(struct inode *ip)
+{
+  struct cpage *gone;
+
+  // most files were never mapped; leave pcache.lock alone.
+  if(ip->pcached == 0)
+    return;
+  ip->pcached = 0;
+  acquire(&pcache.lock);
+  gone = pcache_unlink(pcache_bucket(ip->dev, ip->inum), ip->dev, ip->inum, 0);
+  release(&pcache.lock);
+  pcache_drop(gone);
+}
+
+// Forget every cached page. Called when kalloc() runs dry.
+// Returns the number of pages forgotten.
+int
+pcache_evict(void)
+{
+  struct cpage *gone = 0, *c;
+  int i, n;
+
+  acquire(&pcache.lock);
+  for(i = 0; i < NPCHASH; i++){
+    c = pcache_unlink(&pcache.hash[i], 0, 0, 1);
+    while(c){
+      struct cpage *next = c->next;
+      c->next = gone;
+      gone = c;
+      c = next;
+    }
+  }
+  release(&pcache.lock);
+  n = pcache_drop(gone);
+
+  acquire(&pcache.lock);
+  pcache.nevict += n;
+  release(&pcache.lock);
+  return n;
+}
+
+// Describe the cache for the statistics device.
+int
+pcachestats(char *buf, int sz)
+{
+  int n;
+
+  acquire(&pcache.lock);
+  n = snprintf(buf, sz, "--- pcache: pages %d hit %d miss %d evict %d\n",
+               pcache.n, pcache.nhit, pcache.nmiss, pcache.nevict);
+  release(&pcache.lock);
+  return n;
+}
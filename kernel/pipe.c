@@ -3,10 +3,11 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
 
 #define PIPESIZE 512
 
@@ -17,8 +18,17 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct waitq wq;  // poll()s waiting on either end
 };
 
+static struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +38,13 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->wq.head = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -46,8 +57,10 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    freelock(&pi->lock);
+    kmem_cache_free(pipecache, pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,9 +79,11 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwake(&pi->wq);
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    freelock(&pi->lock);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -87,16 +102,18 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
+      pollwake(&pi->wq);
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      if(copyin_locked(pr->pagetable, &ch, addr + i, 1) == -1)
         break;
       pi->data[pi->nwrite++ % PIPESIZE] = ch;
       i++;
     }
   }
   wakeup(&pi->nread);
+  pollwake(&pi->wq);
   release(&pi->lock);
 
   return i;
@@ -121,10 +138,122 @@ piperead(struct pipe *pi, uint64 addr, int n)
     if(pi->nread == pi->nwrite)
       break;
     ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    if(copyout_locked(pr->pagetable, addr + i, &ch, 1) == -1)
       break;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwake(&pi->wq);
   release(&pi->lock);
   return i;
 }
+
+// Wait until pipe pi has room for more data.
+// Returns 0, or -1 if the read side is closed or the
+// caller has been killed.
+int
+pipewait(struct pipe *pi)
+{
+  struct proc *pr = myproc();
+  int r = 0;
+
+  acquire(&pi->lock);
+  while(pi->nwrite == pi->nread + PIPESIZE){
+    if(pi->readopen == 0 || pr->killed)
+      break;
+    wakeup(&pi->nread);
+    pollwake(&pi->wq);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  if(pi->readopen == 0 || pr->killed)
+    r = -1;
+  release(&pi->lock);
+  return r;
+}
+
+// Copy n bytes at kernel address src into pipe pi, or as
+// many of them as there is room for, without waiting.
+// Returns the number copied, or -1 if the read side is
+// closed.
+int
+pipeput(struct pipe *pi, char *src, int n)
+{
+  int i, m;
+
+  acquire(&pi->lock);
+  if(pi->readopen == 0){
+    release(&pi->lock);
+    return -1;
+  }
+  if(n > pi->nread + PIPESIZE - pi->nwrite)
+    n = pi->nread + PIPESIZE - pi->nwrite;
+  for(i = 0; i < n; i += m){
+    // at most two runs, either side of the end of data[].
+    m = PIPESIZE - pi->nwrite % PIPESIZE;
+    if(m > n - i)
+      m = n - i;
+    memmove(pi->data + pi->nwrite % PIPESIZE, src + i, m);
+    pi->nwrite += m;
+  }
+  wakeup(&pi->nread);
+  pollwake(&pi->wq);
+  release(&pi->lock);
+  return n;
+}
+
+// Take up to n bytes out of pipe pi into kernel address
+// dst, waiting if the pipe is empty. Returns the number
+// taken, 0 once the write side is closed and the pipe
+// is empty, or -1 if killed.
+int
+pipeget(struct pipe *pi, char *dst, int n)
+{
+  struct proc *pr = myproc();
+  int i, m;
+
+  acquire(&pi->lock);
+  while(pi->nread == pi->nwrite && pi->writeopen){
+    if(pr->killed){
+      release(&pi->lock);
+      return -1;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  if(n > pi->nwrite - pi->nread)
+    n = pi->nwrite - pi->nread;
+  for(i = 0; i < n; i += m){
+    m = PIPESIZE - pi->nread % PIPESIZE;
+    if(m > n - i)
+      m = n - i;
+    memmove(dst + i, pi->data + pi->nread % PIPESIZE, m);
+    pi->nread += m;
+  }
+  wakeup(&pi->nwrite);
+  pollwake(&pi->wq);
+  release(&pi->lock);
+  return n;
+}
+
+// Which of events are ready on the read end (writable 0) or
+// the write end of pipe pi, for poll(). Adds e, if not 0,
+// to the pipe's waitq.
+int
+pipepoll(struct pipe *pi, int writable, int events, struct pollent *e)
+{
+  int r = 0;
+
+  acquire(&pi->lock);
+  pollwait(&pi->wq, &pi->lock, e);
+  if(writable){
+    if(pi->readopen == 0)
+      r |= POLLHUP;
+    else if(pi->nwrite != pi->nread + PIPESIZE)
+      r |= events & POLLOUT;
+  } else {
+    if(pi->nread != pi->nwrite)
+      r |= events & POLLIN;
+    if(pi->writeopen == 0)
+      r |= POLLHUP;
+  }
+  release(&pi->lock);
+  return r;
+}
@@ -0,0 +1,146 @@
+//
+// poll(): wait for any of several descriptors to become
+// ready. Each pipe and device that can block keeps a waitq
+// of the pollers waiting on it. filepoll() reports whether a
+// file is ready and, on a poller's first pass, adds an entry
+// for it to the waitq under the same lock, so that a change
+// after the check is not missed. The pipe or device calls
+// pollwake() whenever its state changes, which marks each
+// waiting poller ready and wakes it to look again.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "poll.h"
+#include "defs.h"
+
+// protects struct poller's ready; pollers sleep on it.
+struct spinlock polllock;
+
+void
+pollinit(void)
+{
+  initlock(&polllock, "poll");
+}
+
+// Add poll entry e, if not 0 and not already on a waitq,
+// to waitq q. Caller must hold lk, the lock that protects q.
+void
+pollwait(struct waitq *q, struct spinlock *lk, struct pollent *e)
+{
+  if(e == 0 || e->q)
+    return;
+  e->q = q;
+  e->lk = lk;
+  e->next = q->head;
+  if(q->head)
+    q->head->prev = &e->next;
+  e->prev = &q->head;
+  q->head = e;
+}
+
+// Wake the pollers waiting on q.
+// Caller must hold the lock that protects q.
+void
+pollwake(struct waitq *q)
+{
+  struct pollent *e;
+
+  if(q->head == 0)
+    return;
+  acquire(&polllock);
+  for(e = q->head; e; e = e->next){
+    e->pl->ready = 1;
+    wakeup(e->pl);
+  }
+  release(&polllock);
+}
+
+// Take poll entry e off its waitq, if it is on one.
+static void
+pollcancel(struct pollent *e)
+{
+  if(e->q == 0)
+    return;
+  acquire(e->lk);
+  *e->prev = e->next;
+  if(e->next)
+    e->next->prev = e->prev;
+  release(e->lk);
+  e->q = 0;
+}
+
+// Wait until at least one of the n open files of fds is
+// ready for its events, and set each fds[i].revents. Waits
+// for at most ms milliseconds, or for ever if ms is
+// negative. Returns the number of files with revents set,
+// 0 on timeout, or -1 if killed or out of memory, or if
+// this hart has no room for the deadline.
+int
+pollfiles(struct pollfd *fds, int n, int ms)
+{
+  struct proc *p = myproc();
+  struct pollent *ent;
+  struct poller pl;
+  struct file *f;
+  uint64 when = r_time() + (uint64)ms * (TIMEBASE / 1000);
+  int i, r, first = 1;
+
+  // too big for the kernel stack.
+  if(n > PGSIZE / sizeof(struct pollent) || (ent = kalloc()) == 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    ent[i].pl = &pl;
+    ent[i].q = 0;
+  }
+
+  for(;;){
+    acquire(&polllock);
+    pl.ready = 0;
+    release(&polllock);
+
+    r = 0;
+    for(i = 0; i < n; i++){
+      if(fds[i].fd < 0)
+        fds[i].revents = 0;  // ignored
+      else if(fds[i].fd >= NOFILE || (f = p->ofile[fds[i].fd]) == 0)
+        fds[i].revents = POLLNVAL;
+      else
+        fds[i].revents = filepoll(f, fds[i].events, first ? &ent[i] : 0);
+      if(fds[i].revents)
+        r++;
+    }
+    first = 0;
+    if(r > 0 || ms == 0 || (ms > 0 && r_time() >= when))
+      break;
+
+    acquire(&polllock);
+    if(p->killed){
+      release(&polllock);
+      r = -1;
+      break;
+    }
+    if(!pl.ready){
+      if(ms < 0){
+        sleep(&pl, &polllock);
+      } else if(sleep_until(&pl, &polllock, when) < 0){
+        release(&polllock);
+        r = -1;
+        break;
+      }
+    }
+    release(&polllock);
+  }
+
+  for(i = 0; i < n; i++)
+    pollcancel(&ent[i]);
+  kfree(ent);
+  return r;
+}
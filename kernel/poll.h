@@ -0,0 +1,11 @@
+// A descriptor to wait on, for poll().
+struct pollfd {
+  int fd;
+  short events;   // what to wait for
+  short revents;  // what happened, set by poll()
+};
+
+#define POLLIN   0x001  // reading will not block
+#define POLLOUT  0x004  // writing will not block
+#define POLLHUP  0x010  // the other end of a pipe is closed
+#define POLLNVAL 0x020  // fd is not open
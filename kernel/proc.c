@@ -3,57 +3,184 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "sched.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are allocated as they are needed, each
+// with its own kernel stack, and are never freed: an unused
+// one goes on a free list for the next fork(). So a pointer
+// to a struct proc, and to its locks, stays valid after the
+// process is gone, and code that finds a process without
+// holding a lock that keeps it alive (kill(), and exit()
+// looking at its parent) can lock it and then check that it
+// is still the process it wanted.
+//
+// Live processes are hashed on their pid.
+#define NPIDHASH 127
+
+struct kmem_cache *proccache;
+struct kmem_cache *mmcache;
+struct proc *pidhash[NPIDHASH];
+struct proc *freeproclist;
+int nproc;          // process structures allocated
 
 struct proc *initproc;
 
+// Per-hart run queues of RUNNABLE processes. A process
+// that becomes RUNNABLE joins the queue of the hart it last
+// ran on; see setrunnable(). Each hart runs the processes
+// of its own queue in turn, and when that is empty steals
+// from the longest queue of another hart. A process
+// whose affinity excludes a hart is neither queued nor
+// run there.
+//
+// The policy is chosen at build time. By default each queue
+// is round robin, and a process gives up its hart at every
+// timer interrupt. With SCHED_MLFQ (make SCHEDPOLICY=MLFQ)
+// each queue has NPRIO levels, and a hart runs the first
+// process of the highest non-empty level. A process that
+// runs for its level's whole time slice drops a level; one
+// that sleeps before then keeps its level, so interactive
+// processes stay above CPU-bound ones. Every BOOSTTICKS
+// ticks all processes go back up to their nice level, so
+// that none starves. See timeslice().
+#ifdef SCHED_MLFQ
+#define NPRIO 3
+#define BOOSTTICKS 50
+#else
+#define NPRIO 1
+#endif
+
+// timer ticks a process may run for at level prio.
+#define SLICE(prio) (1 << (prio))
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];  // one list per level, 0 highest
+  struct proc *tail[NPRIO];
+  int n;              // processes queued
+  uint boost;         // boost period last applied to the queue
+
+  // statistics, only updated by the queue's own hart.
+  uint nrun;          // processes this hart ran
+  uint nsteal;        // ... that it took from another queue
+} runq[NCPU];
+
+uint hartmask;        // harts running scheduler(), one bit each
+
+// Sleeping processes, hashed on their wait channel, so that
+// wakeup() only looks at processes that might be sleeping
+// on its channel. Lock order: a bucket's lock, then the
+// p->lock of processes in it.
+#define NCHAN 61
+
+struct chanq {
+  struct spinlock lock;
+  struct proc *head;
+} chanq[NCHAN];
+
+static struct chanq *
+chanbucket(void *chan)
+{
+  return &chanq[((uint64)chan / 8) % NCHAN];
+}
+
 int nextpid = 1;
-struct spinlock pid_lock;
+struct spinlock pid_lock;  // protects nextpid, and the above but proccache
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static int mmalloc(struct proc *p);
+static int mmjoin(struct proc *p, struct mm *mm);
+static void mmput(struct proc *p);
+static void setrunnable(struct proc *p);
+static struct proc *runqget(struct runq *q, int id);
+static int runnable(int id);
+static struct proc *steal(int id);
+static void idle(int id);
+static void wakeidle(uint mask);
 
 extern char trampoline[]; // trampoline.S
 
-// helps ensure that wakeups of wait()ing
-// parents are not lost. helps obey the
-// memory model when using p->parent.
-// must be acquired before any p->lock.
-struct spinlock wait_lock;
-
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// initialize the proc table at boot time.
 void
-proc_mapstacks(pagetable_t kpgtbl) {
+procinit(void)
+{
+  initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NCHAN; i++)
+    initlock(&chanq[i].lock, "chanq");
+  proccache = kmem_cache_create("proc", sizeof(struct proc));
+  mmcache = kmem_cache_create("mm", sizeof(struct mm));
+}
+
+static struct proc **
+pidbucket(int pid)
+{
+  return &pidhash[pid % NPIDHASH];
+}
+
+// Return the live process with the given pid, or 0.
+// Caller must hold pid_lock.
+static struct proc *
+pidlookup(int pid)
+{
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
+
+  for(p = *pidbucket(pid); p; p = p->pidnext)
+    if(p->pid == pid)
+      return p;
+  return 0;
 }
 
-// initialize the proc table at boot time.
-void
-procinit(void)
+// Take an unused process structure from the free list,
+// or make a new one with its own kernel stack slot.
+// Returns 0 if out of memory.
+static struct proc *
+newproc(void)
 {
   struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
+
+  acquire(&pid_lock);
+  if((p = freeproclist) != 0){
+    freeproclist = p->pidnext;
+    p->pidnext = 0;
+    release(&pid_lock);
+    return p;
   }
+  release(&pid_lock);
+
+  if((p = kmem_cache_alloc(proccache)) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  initlock(&p->wlock, "wait");
+  acquire(&pid_lock);
+  p->kstack = KSTACK(nproc);
+  nproc++;
+  release(&pid_lock);
+  return p;
+}
+
+// Free the kernel stacks of unused process structures.
+// Called when kalloc() runs dry.
+// Returns the number of pages freed.
+int
+procreclaim(void)
+{
+  struct proc *p;
+  int n = 0;
+
+  acquire(&pid_lock);
+  for(p = freeproclist; p; p = p->pidnext)
+    n += kvmunstack(p->kstack);
+  release(&pid_lock);
+  return n;
 }
 
 // Must be called with interrupts disabled,
@@ -99,27 +226,28 @@ allocpid() {
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. It gets a new address space,
+// or if mm is not 0 becomes a new thread of mm.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct mm *mm)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
-
-found:
+  if((p = newproc()) == 0)
+    return 0;
+  acquire(&p->lock);
   p->pid = allocpid();
   p->state = USED;
 
+  // Map its kernel stack, which kalloc() may
+  // have taken back while it was unused.
+  if(kvmstack(p->kstack) != 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
@@ -127,9 +255,8 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  // An empty user page table, or a place in mm's.
+  if(mm ? mmjoin(p, mm) != 0 : mmalloc(p) != 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -141,6 +268,11 @@ found:
   p->context.ra = (uint64)forkret;
   p->context.sp = p->kstack + PGSIZE;
 
+  acquire(&pid_lock);
+  p->pidnext = *pidbucket(p->pid);
+  *pidbucket(p->pid) = p;
+  release(&pid_lock);
+
   return p;
 }
 
@@ -150,20 +282,118 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->mm)
+    mmput(p);
+  p->mm = 0;
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  // unhash it, if allocproc() got that far,
+  // and keep it for reuse.
+  acquire(&pid_lock);
+  struct proc **pp;
+  for(pp = pidbucket(p->pid); *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pid = 0;
+  p->pidnext = freeproclist;
+  freeproclist = p;
+  release(&pid_lock);
+}
+
+// Give p a new address space, with an empty user page
+// table and p's trapframe in slot 0.
+// Returns 0 on success, -1 if out of memory.
+static int
+mmalloc(struct proc *p)
+{
+  struct mm *mm;
+
+  if((mm = kmem_cache_alloc(mmcache)) == 0)
+    return -1;
+  memset(mm, 0, sizeof(*mm));
+  initlock(&mm->lock, "mm");
+  initsleeplock(&mm->maplock, "maplock");
+  if((mm->pagetable = proc_pagetable(p)) == 0){
+    freelock(&mm->lock);
+    freelock(&mm->maplock.lk);
+    kmem_cache_free(mmcache, mm);
+    return -1;
+  }
+  mm->ref = 1;
+  mm->nlive = 1;
+  mm->slots = 1;
+  p->mm = mm;
+  p->pagetable = mm->pagetable;
+  p->slot = 0;
+  return 0;
+}
+
+// Make p a new thread of address space mm, with its
+// trapframe in a free slot. Slot 0 is kept for the
+// process's first thread, the one fork() created.
+// Returns 0 on success, -1 if mm has no free slot or
+// there is no memory.
+static int
+mmjoin(struct proc *p, struct mm *mm)
+{
+  int t;
+
+  acquire(&mm->lock);
+  for(t = 1; t < NTHREAD; t++)
+    if((mm->slots & (1 << t)) == 0)
+      break;
+  if(t == NTHREAD || mappages(mm->pagetable, UTRAPFRAME(t), PGSIZE,
+                              (uint64)p->trapframe, PTE_R | PTE_W) != 0){
+    release(&mm->lock);
+    return -1;
+  }
+  mm->slots |= 1 << t;
+  mm->ref++;
+  mm->nlive++;
+  // harts that ran an earlier thread in slot t may
+  // still have its trapframe in their TLBs.
+  __sync_fetch_and_or(&mm->tlbstale, ~0);
+  release(&mm->lock);
+  p->mm = mm;
+  p->pagetable = mm->pagetable;
+  p->slot = t;
+  return 0;
+}
+
+// Take p out of its address space, and free the address
+// space and the user memory if no one else uses it.
+static void
+mmput(struct proc *p)
+{
+  struct mm *mm = p->mm;
+  int last;
+
+  acquire(&mm->lock);
+  uvmunmap(mm->pagetable, UTRAPFRAME(p->slot), 1, 0);
+  mm->slots &= ~(1 << p->slot);
+  if(p->state != ZOMBIE)
+    mm->nlive--;   // allocproc() failed, or fork()
+  last = --mm->ref == 0;
+  release(&mm->lock);
+  if(last){
+    proc_freepagetable(mm->pagetable, mm->sz);
+    freelock(&mm->lock);
+    freelock(&mm->maplock.lk);
+    kmem_cache_free(mmcache, mm);
+  }
 }
 
 // Create a user page table for a given process,
@@ -172,6 +402,7 @@ pagetable_t
 proc_pagetable(struct proc *p)
 {
   pagetable_t pagetable;
+  struct usyscall *u;
 
   // An empty page table.
   pagetable = uvmcreate();
@@ -196,6 +427,21 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the usyscall page, which user code may read
+  // but not write.
+  if((u = kalloc_zeroed()) == 0 ||
+     mappages(pagetable, USYSCALL, PGSIZE, (uint64)u, PTE_R | PTE_U) < 0){
+    if(u)
+      kfree(u);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+  u->pid = p->pid;
+  u->tickcycles = TICKCYCLES;
+  u->nspercycle = NSPERCYCLE;
+
   return pagetable;
 }
 
@@ -206,6 +452,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, USYSCALL, 1, 1);
   uvmfree(pagetable, sz);
 }
 
@@ -227,13 +474,14 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
+  p->affinity = -1;
   
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->mm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -242,29 +490,77 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
 
-  sz = p->sz;
+  acquire(&mm->lock);
+  oldsz = sz = mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // just reserve the address space; vmfault()
+    // allocates each page when it is first touched.
+    if(sz + n > USERTOP || vmaoverlap(p, sz, sz + n)){
+      release(&mm->lock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
-  p->sz = sz;
-  return 0;
+  mm->sz = sz;
+  release(&mm->lock);
+  return oldsz;
+}
+
+// Give np, a new process made by p, its own references to
+// p's open files and current directory, make it p's child,
+// and let it run. Called with np->lock held.
+// Returns np's pid.
+static int
+startchild(struct proc *p, struct proc *np)
+{
+  int i, pid;
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&p->wlock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&p->wlock);
+
+  acquire(&np->lock);
+  np->cpu = p->cpu;
+  np->affinity = p->affinity;
+  np->nrun = 0;
+  np->nmigrate = 0;
+  np->nice = p->nice;
+  np->prio = np->nice;
+  np->used = 0;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
 }
 
 // Create a new process, copying the parent.
@@ -272,22 +568,31 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
   struct proc *np;
   struct proc *p = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child, keeping
+  // the parent's other threads out meanwhile.
+  acquire(&p->mm->lock);
+  if(uvmcopy(p->pagetable, np->pagetable, p->mm->sz) < 0){
+    release(&p->mm->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->mm->sz = p->mm->sz;
+  if(vmadup(p, np) < 0){
+    release(&p->mm->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  release(&p->mm->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -295,51 +600,90 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  return startchild(p, np);
+}
 
-  safestrcpy(np->name, p->name, sizeof(p->name));
+// Create a new thread in the current process's address
+// space, which starts in user space at fn(arg) with stack
+// as its stack pointer. fn must not return. It shares the
+// memory of its creator, and like a fork() child gets its
+// own references to the open files and the current
+// directory. Its creator is its parent, and reaps it
+// with join().
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  struct proc *np;
+  struct proc *p = myproc();
 
-  pid = np->pid;
+  if((np = allocproc(p->mm)) == 0)
+    return -1;
 
-  release(&np->lock);
+  // start with the creator's registers, so that
+  // gp and tp carry over.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
 
-  acquire(&wait_lock);
-  np->parent = p;
-  release(&wait_lock);
+  return startchild(p, np);
+}
 
-  acquire(&np->lock);
-  np->state = RUNNABLE;
-  release(&np->lock);
+// The other threads of p's address space, which exit()
+// kills when the process's first thread exits.
+static void
+killthreads(struct proc *p)
+{
+  int pids[NTHREAD], n = 0;
+  struct proc *q;
 
-  return pid;
+  acquire(&pid_lock);
+  for(int i = 0; i < NPIDHASH; i++)
+    for(q = pidhash[i]; q; q = q->pidnext)
+      if(q != p && q->mm == p->mm && n < NTHREAD)
+        pids[n++] = q->pid;
+  release(&pid_lock);
+  for(int i = 0; i < n; i++)
+    kill(pids[i]);
 }
 
 // Pass p's abandoned children to init.
-// Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
+  struct proc *pp, *last = 0;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
+  acquire(&p->wlock);
+  if(p->children){
+    acquire(&initproc->wlock);
+    for(pp = p->children; pp; pp = pp->sibling){
       pp->parent = initproc;
-      wakeup(initproc);
+      last = pp;
     }
+    last->sibling = initproc->children;
+    initproc->children = p->children;
+    p->children = 0;
+    // some of them may be zombies already.
+    wakeup(initproc);
+    release(&initproc->wlock);
   }
+  release(&p->wlock);
 }
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(), or join() for a
+// thread. The user memory goes with the last thread
+// of the address space; the first thread takes the
+// others with it.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct proc *pp;
+  int last;
 
   if(p == initproc)
     panic("init exiting");
@@ -353,80 +697,119 @@ exit(int status)
     }
   }
 
+  if(p->slot == 0 && mm->ref > 1)
+    killthreads(p);
+  acquire(&mm->lock);
+  last = --mm->nlive == 0;
+  release(&mm->lock);
+  if(last)
+    vmafree(p);
+
   begin_op();
   iput(p->cwd);
   end_op();
   p->cwd = 0;
 
-  acquire(&wait_lock);
-
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup(p->parent);
+  // Parent might be sleeping in wait(). It might also
+  // be exiting and passing p to init, so check that it is
+  // still p's parent once its wlock is held.
+  for(;;){
+    pp = p->parent;
+    acquire(&pp->wlock);
+    if(pp == p->parent)
+      break;
+    release(&pp->wlock);
+  }
+  wakeup(pp);
   
   acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&wait_lock);
+  release(&pp->wlock);
 
   // Jump into the scheduler, never to return.
   sched();
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit, copy its exit status to addr,
+// free it, and return its pid. With tid 0 any child process
+// will do, but not a thread of the caller's own; otherwise
+// only the thread tid.
+// Return -1 if there is no such child.
+static int
+reap(int tid, uint64 addr)
 {
-  struct proc *np;
-  int havekids, pid;
+  struct proc *np, **npp;
+  int pid, havekids;
   struct proc *p = myproc();
 
-  acquire(&wait_lock);
+  acquire(&p->wlock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through our children looking for exited ones.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+    for(npp = &p->children; (np = *npp) != 0; npp = &np->sibling){
+      if(tid ? np->pid != tid || np->mm != p->mm : np->mm == p->mm)
+        continue;
+      havekids = 1;
+
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout_locked(p->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
-          release(&wait_lock);
-          return pid;
+          release(&p->wlock);
+          return -1;
         }
+        *npp = np->sibling;
+        freeproc(np);
         release(&np->lock);
+        release(&p->wlock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
-      release(&wait_lock);
+      release(&p->wlock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &wait_lock);  //DOC: wait-sleep
+    sleep(p, &p->wlock);  //DOC: wait-sleep
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return reap(0, addr);
+}
+
+// Wait for thread tid, which this thread created with
+// clone(), to exit, and return tid.
+// Return -1 if there is no such thread.
+int
+join(int tid, uint64 addr)
+{
+  if(tid <= 0)
+    return -1;
+  return reap(tid, addr);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -439,29 +822,472 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  struct runq *q = &runq[id];
   
   c->proc = 0;
+  __sync_fetch_and_or(&hartmask, 1 << id);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    if((p = runqget(q, id)) == 0 && (p = steal(id)) != 0)
+      q->nsteal++;
+    if(p == 0){
+      // nothing to run: prepare a zeroed page for kalloc_zeroed(),
+      // or if there is none to prepare, wait for an interrupt.
+      if(kzero() == 0)
+        idle(id);
+      continue;
+    }
+
+    // a process that yield()ed or sleep()ed on another hart
+    // may not have switched away yet; its p->lock is held
+    // until it has.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    if(p->cpu != id)
+      p->nmigrate++;
+    p->nrun++;
+    p->cpu = id;
+    c->proc = p;
+    q->nrun++;
+    kvmsync();
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
+  }
+}
+
+// Append p to level p->prio of run queue q.
+// Caller must hold q->lock.
+static void
+enqueue(struct runq *q, struct proc *p)
+{
+  p->rqnext = 0;
+  if(q->tail[p->prio])
+    q->tail[p->prio]->rqnext = p;
+  else
+    q->head[p->prio] = p;
+  q->tail[p->prio] = p;
+}
+
+// Unlink p, which follows prev (or is first if prev is 0),
+// from run queue q. Caller must hold q->lock.
+static void
+dequeue(struct runq *q, struct proc *prev, struct proc *p)
+{
+  if(prev)
+    prev->rqnext = p->rqnext;
+  else
+    q->head[p->prio] = p->rqnext;
+  if(q->tail[p->prio] == p)
+    q->tail[p->prio] = prev;
+  q->n--;
+}
+
+#ifdef SCHED_MLFQ
+// The current boost period. A process that has not been
+// lifted back to its nice level in this period is due.
+static uint
+boostperiod(void)
+{
+  return ticks / BOOSTTICKS;
+}
+
+// Lift every process queued in q back to its nice level.
+// Caller must hold q->lock. The processes are RUNNABLE
+// and queued, so only q's hart may change them.
+static void
+boost(struct runq *q)
+{
+  struct proc *list[NPRIO], *p, *next;
+  int i;
+
+  q->boost = boostperiod();
+  for(i = 0; i < NPRIO; i++){
+    list[i] = q->head[i];
+    q->head[i] = q->tail[i] = 0;
+  }
+  for(i = 0; i < NPRIO; i++){
+    for(p = list[i]; p; p = next){
+      next = p->rqnext;
+      p->prio = p->nice;
+      p->used = 0;
+      p->boost = q->boost;
+      enqueue(q, p);
+    }
+  }
+}
+#endif
+
+// The hart in mask with the shortest run queue.
+static int
+pickcpu(uint mask)
+{
+  int id = -1;
+
+  mask &= hartmask;
+  for(int i = 0; i < NCPU; i++)
+    if((mask & (1 << i)) && (id < 0 || runq[i].n < runq[id].n))
+      id = i;
+  if(id < 0)
+    panic("pickcpu");
+  return id;
+}
+
+// Make p RUNNABLE and append it to the run queue of
+// the hart it last ran on, at level p->prio. So a woken
+// process goes back to the hart whose caches it warmed,
+// unless an idle hart steals it first, or its affinity
+// now excludes that hart. Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q;
+  int n;
+
+  if((p->affinity & (1 << p->cpu)) == 0)
+    p->cpu = pickcpu(p->affinity);
+  q = &runq[p->cpu];
+
+#ifdef SCHED_MLFQ
+  if(p->boost != boostperiod()){
+    p->boost = boostperiod();
+    p->prio = p->nice;
+    p->used = 0;
+  }
+#endif
+  p->state = RUNNABLE;
+  acquire(&q->lock);
+  enqueue(q, p);
+  n = ++q->n;
+  release(&q->lock);
+
+  // wake the queue's hart if it is idle. if it is busy, wake
+  // an idle hart to steal p, unless p is the caller yielding
+  // and there is nothing else to steal. pairs with the
+  // barrier in idle().
+  __sync_synchronize();
+  if(cpus[p->cpu].idle)
+    ipi(p->cpu);
+  else if(p != myproc())
+    wakeidle(p->affinity);
+  else if(n > 1)
+    wakeidle(-1);
+}
+
+// Send an IPI to some idle hart in mask, if there is one,
+// so that it looks for a process to steal.
+static void
+wakeidle(uint mask)
+{
+  for(int i = 0; i < NCPU; i++){
+    if((mask & (1 << i)) && cpus[i].idle){
+      ipi(i);
+      return;
+    }
+  }
+}
+
+// Hart id has nothing to run: wait for an interrupt. The
+// timer is armed only for the next sleep() deadline, or
+// sleep_ns() deadline on this hart, so an idle hart takes
+// no ticks; a hart that makes a process
+// runnable sends it an IPI instead; see setrunnable().
+// Built with PERIODIC_TICK, it spins for up to a tick
+// instead, with the timer ticking as on a busy hart, to
+// compare against.
+static void
+idle(int id)
+{
+  struct cpu *c = &cpus[id];
+  uint64 t0;
+
+#ifdef PERIODIC_TICK
+  t0 = r_time();
+  while(!runnable(id) && r_time() < t0 + TICKCYCLES)
+    __sync_synchronize();
+  c->idlecycles += r_time() - t0;
+  return;
+#endif
+
+  // with interrupts off, an interrupt that arrives after
+  // the check below stays pending and ends the wfi.
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  if(!runnable(id)){
+    timerset(wakeat);
+    t0 = r_time();
+    wfi();
+    c->idlecycles += r_time() - t0;
+    c->nidle++;
+  }
+  c->idle = 0;
+
+  // take the interrupt that ended the wfi, then go back to
+  // ticking, in case there is now a process to run.
+  intr_on();
+  intr_off();
+  clockintr();
+  if(c->tick > r_time() + TICKCYCLES)
+    timerset(r_time() + TICKCYCLES);
+  intr_on();
+}
+
+// Take the first process that hart id may run off the
+// highest level of run queue q that has one, or return 0.
+static struct proc *
+runqget(struct runq *q, int id)
+{
+  struct proc *p = 0, *prev;
+
+  if(q->n == 0)
+    return 0;
+  acquire(&q->lock);
+#ifdef SCHED_MLFQ
+  if(q->boost != boostperiod())
+    boost(q);
+#endif
+  for(int i = 0; i < NPRIO && p == 0; i++){
+    prev = 0;
+    for(p = q->head[i]; p; prev = p, p = p->rqnext){
+      if(p->affinity & (1 << id)){
+        dequeue(q, prev, p);
+        break;
       }
-      release(&p->lock);
     }
   }
+  release(&q->lock);
+  return p;
+}
+
+// Is there a process that hart id may run in any run queue?
+static int
+runnable(int id)
+{
+  struct runq *q;
+  struct proc *p;
+  int found = 0;
+
+  for(q = runq; q < &runq[NCPU] && !found; q++){
+    if(q->n == 0)
+      continue;
+    acquire(&q->lock);
+    for(int i = 0; i < NPRIO && !found; i++)
+      for(p = q->head[i]; p && !found; p = p->rqnext)
+        found = (p->affinity & (1 << id)) != 0;
+    release(&q->lock);
+  }
+  return found;
+}
+
+// Called on each timer interrupt by the process running on
+// this hart. Charges it the tick and returns 1 if it should
+// give up the hart.
+int
+timeslice(void)
+{
+#ifdef SCHED_MLFQ
+  struct proc *p = myproc();
+  struct runq *q;
+  int i, expired;
+
+  acquire(&p->lock);
+  q = &runq[p->cpu];
+  expired = ++p->used >= SLICE(p->prio);
+  if(expired){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->used = 0;
+  }
+  // a process woken at a higher level need not wait
+  // out the rest of this slice.
+  for(i = 0; !expired && i < p->prio; i++)
+    if(q->head[i])
+      expired = 1;
+  release(&p->lock);
+  return expired;
+#else
+  return 1;
+#endif
+}
+
+// Keep the calling process below level nice+inc of the run
+// queues, with the result clamped to the levels there are.
+// Returns the new nice level; under round robin it is
+// always 0.
+int
+nice(int inc)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + inc;
+  if(n < 0)
+    n = 0;
+  if(n > NPRIO-1)
+    n = NPRIO-1;
+  p->nice = n;
+  if(p->prio < n){
+    p->prio = n;
+    p->used = 0;
+  }
+  release(&p->lock);
+  return n;
+}
+
+// Return the process with the given pid, or the caller
+// if pid is 0, with its lock held; or 0.
+static struct proc *
+lockpid(int pid)
+{
+  struct proc *p;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  acquire(&pid_lock);
+  p = pidlookup(pid);
+  release(&pid_lock);
+  if(p == 0)
+    return 0;
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED || p->state == ZOMBIE){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
+// Let process pid (0 for the caller) run only on the harts
+// in mask, one bit each. A process queued on another hart
+// moves now; one running there moves when it next gives up
+// its hart, which the caller does at once. Fork and clone
+// children inherit the mask.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p, *r, *prev = 0;
+  struct runq *q;
+
+  if((mask & hartmask) == 0 || (p = lockpid(pid)) == 0)
+    return -1;
+  q = &runq[p->cpu];
+  acquire(&q->lock);
+  p->affinity = mask;
+  if(p->state == RUNNABLE && (mask & (1 << p->cpu)) == 0){
+    for(r = q->head[p->prio]; r && r != p; prev = r, r = r->rqnext)
+      ;
+    if(r)
+      dequeue(q, prev, p);
+  } else {
+    r = 0;
+  }
+  release(&q->lock);
+  if(r)
+    setrunnable(p);
+  release(&p->lock);
+
+  // the caller is running on hart p->cpu.
+  if(p == myproc() && (mask & (1 << p->cpu)) == 0)
+    yield();
+  return 0;
+}
+
+// The harts process pid (0 for the caller) may run on,
+// or -1.
+int
+getaffinity(int pid)
+{
+  struct proc *p;
+  uint mask;
+
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  mask = p->affinity & hartmask;
+  release(&p->lock);
+  return mask;
+}
+
+// Fill in *si for process pid (0 for the caller).
+int
+schedinfo(int pid, struct schedinfo *si)
+{
+  struct proc *p;
+
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  si->affinity = p->affinity & hartmask;
+  si->cpu = p->cpu;
+  si->nrun = p->nrun;
+  si->nmigrate = p->nmigrate;
+  release(&p->lock);
+  return 0;
+}
+
+// Hart id has nothing to run: take a process from the
+// longest run queue of another hart, or return 0.
+static struct proc *
+steal(int id)
+{
+  struct runq *q, *busiest = 0;
+  struct proc *p;
+
+  for(q = runq; q < &runq[NCPU]; q++)
+    if(q != &runq[id] && q->n > 0 && (busiest == 0 || q->n > busiest->n))
+      busiest = q;
+  if(busiest == 0)
+    return 0;
+  if((p = runqget(busiest, id)) != 0)
+    return p;
+
+  // all there are kept off this hart: try the others.
+  for(q = runq; q < &runq[NCPU]; q++)
+    if(q != &runq[id] && q != busiest && (p = runqget(q, id)) != 0)
+      return p;
+  return 0;
+}
+
+// Describe the run queues for the statistics device.
+int
+schedstats(char *buf, int sz)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "--- processes: %d structures\n", nproc);
+#ifdef SCHED_MLFQ
+  n += snprintf(buf+n, sz-n, "--- run queues: mlfq, %d levels\n", NPRIO);
+#else
+  n += snprintf(buf+n, sz-n, "--- run queues: round robin\n");
+#endif
+  for(int i = 0; i < NCPU; i++){
+    struct runq *q = &runq[i];
+    if(q->nrun == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "hart %d: queued %d ran %d stole %d\n",
+                  i, q->n, q->nrun, q->nsteal);
+  }
+  n += snprintf(buf+n, sz-n, "--- idle harts\n");
+  for(int i = 0; i < NCPU; i++){
+    struct cpu *c = &cpus[i];
+    if(c->ntimer == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "hart %d: idle %d%% wfi %d timer %d ipi %d\n",
+                  i, (int)(c->idlecycles * 100 / r_time()), c->nidle,
+                  c->ntimer, c->nipi);
+  }
+  return n;
 }
 
 // Switch to scheduler.  Must hold only p->lock
@@ -497,7 +1323,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -529,24 +1355,32 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct chanq *b = chanbucket(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's bucket lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the bucket),
   // so it's okay to release lk.
 
+  acquire(&b->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->chnext = b->head;
+  if(b->head)
+    b->head->chprev = &p->chnext;
+  p->chprev = &b->head;
+  b->head = p;
+  release(&b->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() or kill() took us off the bucket.
   p->chan = 0;
 
   // Reacquire original lock.
@@ -554,21 +1388,70 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Take sleeping p off its channel's bucket and make it
+// RUNNABLE. Caller must hold the bucket's lock and p->lock.
+static void
+unsleep(struct proc *p)
+{
+  *p->chprev = p->chnext;
+  if(p->chnext)
+    p->chnext->chprev = p->chprev;
+  p->chnext = 0;
+  p->chprev = 0;
+  setrunnable(p);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+// Wake up at most n processes sleeping on chan, or all
+// of them if n is negative. Returns the number woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct chanq *b = chanbucket(chan);
+  struct proc *p, *next;
+  int woken = 0;
+
+  acquire(&b->lock);
+  for(p = b->head; p && woken != n; p = next){
+    next = p->chnext;
+    if(p->chan == chan){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      unsleep(p);
       release(&p->lock);
+      woken++;
+    }
+  }
+  release(&b->lock);
+  return woken;
+}
+
+// Wake up all processes sleeping on a channel in [lo, hi).
+// Must be called without any p->lock.
+void
+wakeuprange(void *lo, void *hi)
+{
+  struct chanq *b;
+  struct proc *p, *next;
+
+  for(b = chanq; b < &chanq[NCHAN]; b++){
+    acquire(&b->lock);
+    for(p = b->head; p; p = next){
+      next = p->chnext;
+      if(p->chan >= lo && p->chan < hi){
+        acquire(&p->lock);
+        unsleep(p);
+        release(&p->lock);
+      }
     }
+    release(&b->lock);
   }
 }
 
@@ -579,21 +1462,34 @@ int
 kill(int pid)
 {
   struct proc *p;
+  struct chanq *b;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  acquire(&pid_lock);
+  p = pidlookup(pid);
+  release(&pid_lock);
+  if(p == 0)
+    return -1;
+
+  acquire(&p->lock);
+  if(p->pid != pid){
+    // it was reaped meanwhile.
     release(&p->lock);
+    return -1;
   }
-  return -1;
+  p->killed = 1;
+  while(p->state == SLEEPING){
+    // Wake process from sleep(). The bucket lock
+    // comes first, so look again once we have it.
+    b = chanbucket(p->chan);
+    release(&p->lock);
+    acquire(&b->lock);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && chanbucket(p->chan) == b)
+      unsleep(p);
+    release(&b->lock);
+  }
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -611,6 +1507,19 @@ either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
   }
 }
 
+// either_copyout() for a caller holding a spinlock.
+int
+either_copyout_locked(int user_dst, uint64 dst, void *src, uint64 len)
+{
+  struct proc *p = myproc();
+  if(user_dst){
+    return copyout_locked(p->pagetable, dst, src, len);
+  } else {
+    memmove((char *)dst, src, len);
+    return 0;
+  }
+}
+
 // Copy from either a user address, or kernel address,
 // depending on usr_src.
 // Returns 0 on success, -1 on error.
@@ -643,14 +1552,18 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
+  for(int i = 0; i < NPIDHASH; i++){
+    // a process that exits meanwhile takes us to the
+    // free list, which ends too.
+    for(p = pidhash[i]; p; p = p->pidnext){
+      if(p->state == UNUSED)
+        continue;
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s", p->pid, state, p->name);
+      printf("\n");
+    }
   }
 }
@@ -24,6 +24,19 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint kvmgen;                // Kernel page table changes seen; see kvmsync()
+  uint64 asidgen;             // ASID generation the TLB was last flushed for
+  struct mm *umm;             // Address space running in user mode, or null
+  uint ntrap;                 // Traps from user mode; see tlbflush()
+  uint64 timer;               // When its timer is armed for; see timerset()
+  uint64 tick;                // When it next calls clockintr()
+  int idle;                   // Waiting in wfi; see idle()
+
+  // statistics.
+  uint64 idlecycles;          // timer cycles spent in wfi
+  uint nidle;                 // times it waited in wfi
+  uint ntimer;                // timer interrupts taken
+  uint nipi;                  // IPIs taken
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +93,40 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's address space: a program
+// segment or an mmap() region. Pages are filled when
+// first touched; see vmfault().
+struct vma {
+  uint64 va;          // start, page-aligned
+  uint64 end;         // one past the last byte; 0 if the slot is free
+  struct inode *ip;   // holds a reference; 0 for anonymous memory
+  uint off;           // file offset of va
+  uint filesz;        // bytes from the file; the rest is zero
+  int perm;           // PTE_R, PTE_W, PTE_X
+  int flags;          // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+};
+
+// A user address space, shared by the threads of a
+// process; see clone().
+struct mm {
+  // protects the rest, and the user part of pagetable.
+  struct spinlock lock;
+
+  // held while reading a page of a mapped file, since that
+  // sleeps, and while changing or removing regions.
+  struct sleeplock maplock;
+
+  int ref;                     // Processes using it, exited or not
+  int nlive;                   // ... that have not exited yet
+  uint slots;                  // Trapframe slots in use; see UTRAPFRAME()
+  uint64 sz;                   // Size of process memory (bytes)
+  pagetable_t pagetable;       // User page table
+  uint asid;                   // Address-space identifier of pagetable
+  uint64 asidgen;              // ... and its generation; 0 if none yet
+  uint tlbstale;               // Harts whose TLB may hold stale entries for asid
+  struct vma vma[NVMA];        // File-backed memory regions
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -92,14 +139,44 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Hart it last ran on, whose run queue it joins
+  uint64 twhen;                // sleep_ns() deadline, in timer cycles
+  int tindex;                  // Place in a timer heap, or -1; see timer.c
+  void *tchan;                 // What to wake at twhen
+  uint affinity;               // Harts it may run on; also the run queue's lock
+                               // to change while it is queued
+  uint nrun;                   // Times it was scheduled
+  uint nmigrate;               // ... on another hart than the time before
+  int nice;                    // Highest run queue level it may run at
+  int prio;                    // Run queue level it joins; see setrunnable()
+  int used;                    // Timer ticks it has run for at this level
+  uint boost;                  // Boost period it was last lifted in
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next in pid hash bucket, or on the free list
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE process on the run queue
 
-  // wait_lock must be held when using this:
+  // the wait channel bucket's lock and p->lock must be held to change these:
+  struct proc *chnext;         // Next process sleeping in chan's bucket
+  struct proc **chprev;        // Link that points to this one
+
+  // protects children, and the parent and sibling of each of them.
+  // a process's wlock must be acquired before its parent's,
+  // and before any p->lock.
+  struct spinlock wlock;
+  struct proc *children;       // List of children, linked by sibling
+
+  // the parent's wlock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *sibling;        // Next child of parent
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm *mm;               // User address space
+  pagetable_t pagetable;       // mm->pagetable
+  int slot;                    // Where trapframe is mapped; see UTRAPFRAME()
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
@@ -0,0 +1,43 @@
+// A submission and completion ring for ring_enter(), kept in
+// user memory. The process fills in entries of sq[] and
+// advances sqtail; ring_enter() takes entries from sqhead,
+// runs each as the system call it stands for, and posts its
+// result in cq[] at cqtail. The process takes completions
+// from cqhead. Indexes only grow; an entry's slot is its
+// index modulo RING_SIZE.
+
+#define RING_SIZE 64
+
+// operations
+#define RING_NOP    0
+#define RING_READ   1   // read(fd, addr, len)
+#define RING_WRITE  2   // write(fd, addr, len)
+#define RING_OPEN   3   // open(addr, len)
+#define RING_CLOSE  4   // close(fd)
+
+// flags
+#define RING_OPENFD 0x1 // fd is the one the last RING_OPEN
+                        // of this ring_enter() returned
+
+struct sqe {
+  int op;
+  int flags;
+  int fd;
+  int len;       // byte count, or the mode for RING_OPEN
+  uint64 addr;   // buffer, or the path for RING_OPEN
+  uint64 data;   // handed back in the completion
+};
+
+struct cqe {
+  uint64 data;   // from the submission
+  int res;       // what the system call would have returned
+};
+
+struct ring {
+  uint sqhead;   // advanced by the kernel
+  uint sqtail;
+  uint cqhead;
+  uint cqtail;   // advanced by the kernel
+  struct sqe sq[RING_SIZE];
+  struct cqe cq[RING_SIZE];
+};
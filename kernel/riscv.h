@@ -75,6 +75,14 @@ w_sip(uint64 x)
   asm volatile("csrw sip, %0" : : "r" (x));
 }
 
+// clear the bits of x in sip, atomically, so that a bit
+// machine mode sets meanwhile is not lost.
+static inline void
+c_sip(uint64 x)
+{
+  asm volatile("csrc sip, %0" : : "r" (x));
+}
+
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
@@ -198,6 +206,10 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the address-space identifier field of satp.
+#define SATP_ASID(asid) (((uint64)(asid)) << 44)
+#define SATP2ASID(satp) (((satp) >> 44) & 0xffff)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -260,6 +272,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor Counter-Enable
+static inline void
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -269,6 +296,14 @@ r_time()
   return x;
 }
 
+// wait for an interrupt. returns when one is pending,
+// even if interrupts are disabled.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -331,8 +366,16 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
+#define MEGAPGSIZE (512*PGSIZE) // bytes per level-1 megapage
 #define PGSHIFT 12  // bits of offset within a page
 
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
@@ -343,6 +386,8 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // RSW bit: shared copy-on-write page
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -351,6 +396,10 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a valid PTE with any of R, W, X set is a leaf, not a
+// pointer to the next level of the page table.
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
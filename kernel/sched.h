@@ -0,0 +1,7 @@
+// Scheduling statistics of a process, from schedinfo().
+struct schedinfo {
+  uint affinity;  // harts it may run on, one bit each
+  int cpu;        // hart it last ran on
+  uint nrun;      // times it was scheduled
+  uint nmigrate;  // ... on another hart than the time before
+};
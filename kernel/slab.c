@@ -0,0 +1,307 @@
+// Slab allocator for small kernel objects, layered on kalloc().
+//
+// Each cache hands out objects of one size, carved out of
+// page-sized slabs. A slab page starts with a struct slab
+// header followed by as many objects as fit; free objects
+// in a slab are chained through their first word.
+//
+// In front of the slabs, each hart has a magazine: a small
+// stack of free objects that kmem_cache_alloc() and
+// kmem_cache_free() use without touching the cache's lock.
+// A magazine's own lock is only ever contended while
+// kmem_cache_reap() is emptying it from another hart.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE   16  // maximum number of caches
+#define MAGSIZE  16  // objects per hart magazine
+
+struct slab {
+  struct slab *next;   // on the cache's partial list
+  struct slab *prev;
+  void *free;          // chain of free objects
+  int inuse;           // objects handed out
+};
+
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+  uint nalloc;               // kmem_cache_alloc() calls
+  uint nmiss;                // ... that found the magazine empty
+};
+
+struct kmem_cache {
+  struct spinlock lock;      // protects the slab lists
+  char *name;
+  uint size;                 // object size, rounded up
+  int perslab;               // objects per slab page
+  struct slab partial;       // slabs with free objects; circular
+  int nslab;                 // slab pages owned
+  int nempty;                // slabs with no objects in use
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} caches;
+
+void
+slabinit(void)
+{
+  initlock(&caches.lock, "caches");
+}
+
+// Create a cache of size-byte objects.
+struct kmem_cache *
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: too big");
+
+  acquire(&caches.lock);
+  if(caches.n >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &caches.cache[caches.n++];
+  release(&caches.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "magazine");
+  return c;
+}
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+}
+
+// Turn a fresh page into a slab of c's objects.
+static struct slab *
+slab_new(struct kmem_cache *c, char *page)
+{
+  struct slab *s = (struct slab*)page;
+  char *obj = page + sizeof(struct slab);
+
+  s->free = 0;
+  s->inuse = 0;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    *(void**)(obj + i*c->size) = s->free;
+    s->free = obj + i*c->size;
+  }
+  return s;
+}
+
+// Take up to n objects from c's slabs into v[].
+// Caller holds c->lock. Returns the number taken.
+static int
+slab_get(struct kmem_cache *c, void **v, int n)
+{
+  int got = 0;
+
+  while(got < n && c->partial.next != &c->partial){
+    struct slab *s = c->partial.next;
+    void *obj = s->free;
+    s->free = *(void**)obj;
+    if(s->inuse++ == 0)
+      c->nempty--;
+    if(s->free == 0)
+      slab_unlink(s);
+    v[got++] = obj;
+  }
+  return got;
+}
+
+// Return obj to its slab. Caller holds c->lock.
+// Returns the slab's page if it became empty and
+// should be given back to kalloc, else 0.
+static void *
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->free == 0)
+    slab_link(c, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    // keep one empty slab around to absorb
+    // alloc/free ping-pong at a slab boundary.
+    if(c->nempty > 0){
+      slab_unlink(s);
+      c->nslab--;
+      return s;
+    }
+    c->nempty++;
+  }
+  return 0;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+again:
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  pop_off();
+  m->nalloc++;
+  if(m->n == 0){
+    // magazine is empty: refill half of it from the slabs.
+    m->nmiss++;
+    acquire(&c->lock);
+    m->n = slab_get(c, m->obj, MAGSIZE/2);
+    release(&c->lock);
+  }
+  if(m->n > 0){
+    obj = m->obj[--m->n];
+    release(&m->lock);
+    return obj;
+  }
+  release(&m->lock);
+
+  // every slab is full: grow the cache by a page.
+  char *page = kalloc();
+  if(page == 0)
+    return 0;
+  struct slab *s = slab_new(c, page);
+  acquire(&c->lock);
+  slab_link(c, s);
+  c->nslab++;
+  c->nempty++;
+  release(&c->lock);
+  goto again;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+  void *pages[MAGSIZE/2];
+  int npages = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  pop_off();
+  if(m->n == MAGSIZE){
+    // magazine is full: give half of it back to the slabs.
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2){
+      void *pg = slab_put(c, m->obj[--m->n]);
+      if(pg)
+        pages[npages++] = pg;
+    }
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+
+  for(int i = 0; i < npages; i++)
+    kfree(pages[i]);
+}
+
+// Empty every magazine of every cache back into the slabs
+// and give all empty slab pages back to kalloc.
+// Called when kalloc() runs dry.
+// Returns the number of pages freed.
+int
+kmem_cache_reap(void)
+{
+  int i, j, n, freed = 0;
+
+  acquire(&caches.lock);
+  n = caches.n;
+  release(&caches.lock);
+
+  for(i = 0; i < n; i++){
+    struct kmem_cache *c = &caches.cache[i];
+    for(j = 0; j < NCPU; j++){
+      struct magazine *m = &c->mag[j];
+      acquire(&m->lock);
+      acquire(&c->lock);
+      while(m->n > 0){
+        void *pg = slab_put(c, m->obj[--m->n]);
+        if(pg){
+          release(&c->lock);
+          kfree(pg);
+          freed++;
+          acquire(&c->lock);
+        }
+      }
+      release(&c->lock);
+      release(&m->lock);
+    }
+
+    // free the one empty slab slab_put() keeps in reserve.
+    acquire(&c->lock);
+    struct slab *s, *empty = 0;
+    for(s = c->partial.next; s != &c->partial; s = s->next){
+      if(s->inuse == 0){
+        empty = s;
+        break;
+      }
+    }
+    if(empty){
+      slab_unlink(empty);
+      c->nslab--;
+      c->nempty--;
+    }
+    release(&c->lock);
+    if(empty){
+      kfree(empty);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+// Describe each cache for the statistics device.
+int
+slabstats(char *buf, int sz)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "--- slab caches\n");
+  acquire(&caches.lock);
+  for(int i = 0; i < caches.n; i++){
+    struct kmem_cache *c = &caches.cache[i];
+    uint nalloc = 0, nmiss = 0;
+    for(int j = 0; j < NCPU; j++){
+      nalloc += c->mag[j].nalloc;
+      nmiss += c->mag[j].nmiss;
+    }
+    n += snprintf(buf+n, sz-n, "%s: size %d slabs %d alloc %d miss %d\n",
+                  c->name, c->size, c->nslab, nalloc, nmiss);
+  }
+  release(&caches.lock);
+  return n;
+}
@@ -4,16 +4,55 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
 
+// registry of locks, so that the statistics device
+// can report the most contended ones.
+#define NLOCK 500
+
+static struct spinlock *locks[NLOCK];
+static struct spinlock lock_locks;
+
+static void
+findslot(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == 0){
+      locks[i] = lk;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->n = 0;
+  lk->nts = 0;
+  if(lk != &lock_locks)
+    findslot(lk);
+}
+
+// Forget a lock that lives in memory about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i] == lk){
+      locks[i] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
 }
 
 // Acquire the lock.
@@ -29,8 +68,9 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  __sync_fetch_and_add(&lk->n, 1);
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    __sync_fetch_and_add(&lk->nts, 1);
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -108,3 +148,44 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+int
+snprint_lock(char *buf, int sz, struct spinlock *lk)
+{
+  int n = 0;
+  if(lk->n > 0)
+    n = snprintf(buf, sz, "lock: %s: #test-and-set %d #acquire() %d\n",
+                 lk->name, lk->nts, lk->n);
+  return n;
+}
+
+// Report the most contended locks for the statistics device.
+int
+statslock(char *buf, int sz)
+{
+  int n;
+  int tot = 0;
+
+  acquire(&lock_locks);
+  n = snprintf(buf, sz, "--- top 5 contended locks:\n");
+  uint last = ~0U;
+  for(int t = 0; t < 5; t++){
+    struct spinlock *top = 0;
+    for(int i = 0; i < NLOCK; i++){
+      struct spinlock *lk = locks[i];
+      if(lk && lk->nts < last && (top == 0 || lk->nts > top->nts))
+        top = lk;
+    }
+    if(top == 0 || top->nts == 0)
+      break;
+    n += snprint_lock(buf+n, sz-n, top);
+    last = top->nts;
+  }
+  for(int i = 0; i < NLOCK; i++){
+    if(locks[i])
+      tot += locks[i]->nts;
+  }
+  n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  release(&lock_locks);
+  return n;
+}
@@ -0,0 +1,72 @@
+//
+// The statistics device: reading it returns a text report
+// of kernel counters (lock contention, allocator state, ...).
+// A reader gets a snapshot taken when it starts reading,
+// and end-of-file once the whole snapshot has been read.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquire(&stats.lock);
+
+  if(stats.sz == 0) {
+    stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += kallocstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += slabstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += pcachestats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += schedstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += vmstats(stats.buf+stats.sz, BUFSZ-stats.sz);
+  }
+  m = stats.sz - stats.off;
+
+  if (m > 0) {
+    if(m > n)
+      m  = n;
+    if(either_copyout_locked(user_dst, dst, stats.buf+stats.off, m) != -1) {
+      stats.off += m;
+    }
+  } else {
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
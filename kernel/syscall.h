@@ -20,3 +20,22 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_clone  24
+#define SYS_join   25
+#define SYS_futex_wait 26
+#define SYS_futex_wake 27
+#define SYS_nice   28
+#define SYS_sched_setaffinity 29
+#define SYS_sched_getaffinity 30
+#define SYS_schedinfo 31
+#define SYS_clock_ns 32
+#define SYS_sleep_ns 33
+#define SYS_ring_enter 34
+#define SYS_readv  35
+#define SYS_writev 36
+#define SYS_pread  37
+#define SYS_pwrite 38
+#define SYS_splice 39
+#define SYS_poll   40
@@ -10,11 +10,23 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
+#include "ring.h"
+#include "poll.h"
+
+// The struct file of the caller's file descriptor fd, or 0.
+static struct file*
+fdfile(int fd)
+{
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  return myproc()->ofile[fd];
+}
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -26,7 +38,7 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f = fdfile(fd)) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -75,6 +87,8 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  if(n > 0)
+    vmaprefault(p, n, 1);  // devices and pipes copy with locks held
   return fileread(f, p, n);
 }
 
@@ -87,23 +101,162 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  if(n > 0)
+    vmaprefault(p, n, 0);
 
   return filewrite(f, p, n);
 }
 
-uint64
-sys_close(void)
+static int
+fdclose(int fd)
 {
-  int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if((f = fdfile(fd)) == 0)
     return -1;
   myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
 
+// Fetch the n buffers of the user iovec array at addr into
+// iov, and map them in for filereadv() or filewritev().
+// Returns 0, or -1 if they are too many or too big.
+static int
+argiov(uint64 addr, int n, struct iovec *iov, int write)
+{
+  uint64 total = 0;
+
+  if(n < 0 || n > IOV_MAX)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, addr, n*sizeof(struct iovec)) < 0)
+    return -1;
+  for(int i = 0; i < n; i++){
+    total += iov[i].iov_len;
+    if(total > 0x7fffffff)  // the count returned is an int
+      return -1;
+    if(iov[i].iov_len > 0)
+      vmaprefault((uint64)iov[i].iov_base, iov[i].iov_len, write);
+  }
+  return 0;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int n;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(argiov(p, n, iov, 1) < 0)
+    return -1;
+  return filereadv(f, iov, n, -1);
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int n;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(argiov(p, n, iov, 0) < 0)
+    return -1;
+  return filewritev(f, iov, n, -1);
+}
+
+// pread(fd, buf, n, off) and pwrite(fd, buf, n, off):
+// read() and write() at offset off of a file, leaving the
+// file's own offset alone.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || n < 0 || off < 0)
+    return -1;
+  if(n > 0)
+    vmaprefault(p, n, 1);
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || n < 0 || off < 0)
+    return -1;
+  if(n > 0)
+    vmaprefault(p, n, 0);
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, off);
+}
+
+// splice(in, out, n): move up to n bytes from fd in to
+// fd out without copying them to user space; one of the
+// two must be a file and the other a pipe.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+// poll(fds, n, ms): wait up to ms milliseconds, or for
+// ever if ms is negative, for any of the n descriptors in
+// fds to be ready, and return how many are.
+uint64
+sys_poll(void)
+{
+  struct pollfd fds[NOFILE];
+  int n, ms, r;
+  uint64 p;
+
+  if(argaddr(0, &p) < 0 || argint(1, &n) < 0 || argint(2, &ms) < 0)
+    return -1;
+  if(n < 0 || n > NOFILE)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)fds, p, n*sizeof(struct pollfd)) < 0)
+    return -1;
+  if((r = pollfiles(fds, n, ms)) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, p, (char*)fds, n*sizeof(struct pollfd)) < 0)
+    return -1;
+  return r;
+}
+
+uint64
+sys_close(void)
+{
+  int fd;
+
+  if(argint(0, &fd) < 0)
+    return -1;
+  return fdclose(fd);
+}
+
 uint64
 sys_fstat(void)
 {
@@ -258,8 +411,10 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
-    panic("create: ialloc");
+  if((ip = ialloc(dp->dev, type)) == 0){
+    iunlockput(dp);
+    return 0;
+  }
 
   ilock(ip);
   ip->major = major;
@@ -268,32 +423,43 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
-    dp->nlink++;  // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+      goto fail;
   }
 
+  // fails if name is there after all, and dirlookup()
+  // above ran out of memory for its inode.
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto fail;
+
+  if(type == T_DIR){
+    // now that success is guaranteed:
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+ fail:
+  // something went wrong. de-allocate ip.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with open() mode omode, and return the new
+// file descriptor, or -1.
+static int
+openpath(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
-    return -1;
 
   begin_op();
 
@@ -351,6 +517,17 @@ sys_open(void)
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0)
+    return -1;
+  return openpath(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -484,3 +661,112 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f = 0;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 ||
+     argint(2, &prot) < 0 || argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  // addr is only a hint, and is ignored.
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+// Run ring entry s as the system call it stands for, and
+// return what that would.
+static int
+ringop(struct sqe *s)
+{
+  char path[MAXPATH];
+  struct file *f;
+
+  switch(s->op){
+  case RING_NOP:
+    return 0;
+  case RING_READ:
+  case RING_WRITE:
+    if((f = fdfile(s->fd)) == 0)
+      return -1;
+    if(s->len > 0)
+      vmaprefault(s->addr, s->len, s->op == RING_READ);
+    if(s->op == RING_READ)
+      return fileread(f, s->addr, s->len);
+    return filewrite(f, s->addr, s->len);
+  case RING_OPEN:
+    if(fetchstr(s->addr, path, MAXPATH) < 0)
+      return -1;
+    return openpath(path, s->len);
+  case RING_CLOSE:
+    return fdclose(s->fd);
+  }
+  return -1;
+}
+
+#define RINGOFF(field) ((uint64)&((struct ring*)0)->field)
+
+// ring_enter(struct ring *r, int n): run up to n of the
+// entries posted in r's submission queue, in order, with
+// a completion for each, for the cost of one trap. Stops
+// early if the completion queue fills up, or at an entry
+// or completion slot it can't copy; the ring's indexes then
+// still cover the entries run before it.
+// Returns the number run, or -1 if none could be.
+uint64
+sys_ring_enter(void)
+{
+  struct proc *p = myproc();
+  uint64 r;
+  int n, done, err, openfd = -1;
+  uint idx[4];  // sqhead, sqtail, cqhead, cqtail
+  struct sqe s;
+  struct cqe c;
+
+  if(argaddr(0, &r) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(copyin(p->pagetable, (char*)idx, r, sizeof(idx)) < 0)
+    return -1;
+  done = err = 0;
+  while(done < n && idx[0] != idx[1] && idx[3] - idx[2] < RING_SIZE){
+    if(copyin(p->pagetable, (char*)&s, r + RINGOFF(sq[idx[0] % RING_SIZE]), sizeof(s)) < 0){
+      err = 1;
+      break;
+    }
+    idx[0]++;
+    if(s.flags & RING_OPENFD)
+      s.fd = openfd;
+    c.data = s.data;
+    c.res = ringop(&s);
+    if(s.op == RING_OPEN)
+      openfd = c.res;
+    if(copyout(p->pagetable, r + RINGOFF(cq[idx[3] % RING_SIZE]), (char*)&c, sizeof(c)) < 0){
+      // it ran, so it stays consumed, but has no completion.
+      done++;
+      err = 1;
+      break;
+    }
+    idx[3]++;
+    done++;
+    if(p->killed)
+      break;
+  }
+  if(copyout(p->pagetable, r + RINGOFF(sqhead), (char*)&idx[0], sizeof(uint)) < 0 ||
+     copyout(p->pagetable, r + RINGOFF(cqtail), (char*)&idx[3], sizeof(uint)) < 0)
+    return -1;
+  return err && done == 0 ? -1 : done;
+}
@@ -5,7 +5,9 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "sched.h"
 
 uint64
 sys_exit(void)
@@ -35,21 +37,110 @@ sys_wait(void)
   uint64 p;
   if(argaddr(0, &p) < 0)
     return -1;
+  if(p != 0)
+    vmaprefault(p, sizeof(int), 1);  // wait() copies out with locks held
   return wait(p);
 }
 
 uint64
 sys_sbrk(void)
 {
-  int addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  return growproc(n);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
     return -1;
-  return addr;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  if(p != 0)
+    vmaprefault(p, sizeof(int), 1);  // join() copies out with locks held
+  return join(tid, p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
+
+uint64
+sys_nice(void)
+{
+  int inc;
+
+  if(argint(0, &inc) < 0)
+    return -1;
+  return nice(inc);
+}
+
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+uint64
+sys_sched_getaffinity(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return getaffinity(pid);
+}
+
+uint64
+sys_schedinfo(void)
+{
+  int pid;
+  uint64 addr;
+  struct schedinfo si;
+
+  if(argint(0, &pid) < 0 || argaddr(1, &addr) < 0)
+    return -1;
+  if(schedinfo(pid, &si) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&si, sizeof(si)) < 0)
+    return -1;
+  return 0;
 }
 
 uint64
@@ -67,6 +158,9 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
+    // make sure some hart's timer goes off in time.
+    if(((uint64)ticks0 + n) * TICKCYCLES < wakeat)
+      wakeat = ((uint64)ticks0 + n) * TICKCYCLES;
     sleep(&ticks, &tickslock);
   }
   release(&tickslock);
@@ -95,3 +189,20 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// nanoseconds since boot.
+uint64
+sys_clock_ns(void)
+{
+  return r_time() * NSPERCYCLE;
+}
+
+uint64
+sys_sleep_ns(void)
+{
+  uint64 ns;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return sleep_ns(ns);
+}
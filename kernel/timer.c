@@ -0,0 +1,183 @@
+//
+// High-resolution sleep: sleep_ns() puts a process to sleep
+// until a deadline in timer cycles, well below a tick. Each
+// hart keeps a min-heap of the deadlines of the processes
+// that went to sleep on it, and timerset() arms the hart's
+// CLINT timer for the earliest of them if that comes before
+// its next tick. The timer interrupt then wakes every
+// process whose deadline has passed; see timerexpire().
+// sleep_until() puts a deadline on an ordinary sleep() the
+// same way, for poll().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NTIMER 64  // sleep_ns() sleepers per hart
+
+struct theap {
+  struct spinlock lock;
+  uint64 next;                // earliest deadline, or -1; read without the lock
+  int n;
+  struct proc *p[NTIMER];     // heap ordered on p->twhen
+} theap[NCPU];
+
+void
+theapinit(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    initlock(&theap[i].lock, "timer");
+    theap[i].next = -1;
+  }
+}
+
+// Put h->p[i] where it belongs: up towards the root if its
+// deadline is earlier than its parent's, else down.
+static void
+heapfix(struct theap *h, int i)
+{
+  struct proc *p = h->p[i];
+  int c;
+
+  while(i > 0 && h->p[(i-1)/2]->twhen > p->twhen){
+    h->p[i] = h->p[(i-1)/2];
+    h->p[i]->tindex = i;
+    i = (i-1)/2;
+  }
+  while((c = 2*i + 1) < h->n){
+    if(c+1 < h->n && h->p[c+1]->twhen < h->p[c]->twhen)
+      c++;
+    if(h->p[c]->twhen >= p->twhen)
+      break;
+    h->p[i] = h->p[c];
+    h->p[i]->tindex = i;
+    i = c;
+  }
+  h->p[i] = p;
+  p->tindex = i;
+}
+
+// Take p out of heap h. Caller must hold h->lock.
+static void
+heapremove(struct theap *h, struct proc *p)
+{
+  int i = p->tindex;
+
+  p->tindex = -1;
+  if(--h->n != i){
+    h->p[i] = h->p[h->n];
+    heapfix(h, i);
+  }
+  h->next = h->n ? h->p[0]->twhen : -1;
+}
+
+// The earliest sleep_ns() deadline on this hart, or -1.
+// Caller must have interrupts off.
+uint64
+timernext(void)
+{
+  return theap[cpuid()].next;
+}
+
+// Called by the timer interrupt: wake the processes that
+// went to sleep on this hart and whose deadlines have
+// passed.
+void
+timerexpire(void)
+{
+  struct theap *h = &theap[cpuid()];
+  uint64 now = r_time();
+  struct proc *p;
+
+  if(h->next > now)
+    return;
+  acquire(&h->lock);
+  while(h->n > 0 && (p = h->p[0])->twhen <= now){
+    heapremove(h, p);
+    wakeup(p->tchan);
+  }
+  release(&h->lock);
+}
+
+// Sleep for at least ns nanoseconds, or until killed.
+// Returns 0, or -1 if killed or if too many processes
+// are sleeping on this hart.
+int
+sleep_ns(uint64 ns)
+{
+  struct proc *p = myproc();
+  struct theap *h;
+  int r = 0;
+
+  if(ns == 0)
+    return 0;
+  push_off();
+  h = &theap[cpuid()];
+  acquire(&h->lock);
+  pop_off();
+  if(h->n == NTIMER){
+    release(&h->lock);
+    return -1;
+  }
+  p->twhen = r_time() + (ns + NSPERCYCLE - 1) / NSPERCYCLE;
+  p->tchan = &p->twhen;
+  h->p[h->n++] = p;
+  heapfix(h, h->n - 1);
+  h->next = h->p[0]->twhen;
+  // still on h's hart, with interrupts off: arm its
+  // timer for the new deadline if that is the first.
+  timerset(mycpu()->tick);
+
+  while(r_time() < p->twhen){
+    if(p->killed){
+      r = -1;
+      break;
+    }
+    sleep(&p->twhen, &h->lock);
+  }
+  if(p->tindex >= 0)
+    heapremove(h, p);
+  release(&h->lock);
+  return r;
+}
+
+// Like sleep(chan, lk), but also wake up at time when, in
+// timer cycles, if nothing else has by then. As with sleep(),
+// the caller must check again what it was waiting for.
+// Returns 0, or -1 without sleeping if too many processes
+// are sleeping on this hart.
+int
+sleep_until(void *chan, struct spinlock *lk, uint64 when)
+{
+  struct proc *p = myproc();
+  struct theap *h = &theap[cpuid()];  // holding lk, so interrupts are off
+
+  acquire(&h->lock);
+  if(h->n == NTIMER){
+    release(&h->lock);
+    return -1;
+  }
+  p->twhen = when;
+  p->tchan = chan;
+  h->p[h->n++] = p;
+  heapfix(h, h->n - 1);
+  h->next = h->p[0]->twhen;
+  timerset(mycpu()->tick);
+  release(&h->lock);
+
+  // interrupts stay off until sleep() has put p on chan, so
+  // this hart's timer cannot expire the deadline before then.
+  sleep(chan, lk);
+
+  acquire(&h->lock);
+  if(p->tindex >= 0)
+    heapremove(h, p);
+  release(&h->lock);
+  return 0;
+}
@@ -3,11 +3,19 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
+// Each hart arms its own timer: a tick ahead while it runs
+// a process, and only for the next sleep() deadline while
+// it is idle; see idle() in proc.c. So ticks is not counted
+// but worked out from the time CSR, by whichever hart's
+// timer goes off. The timer also goes off for sleep_ns()
+// deadlines in between; see timer.c.
 struct spinlock tickslock;
 uint ticks;
+uint64 wakeat;  // earliest sleep() deadline, in timer cycles
 
 extern char trampoline[], uservec[], userret[];
 
@@ -20,6 +28,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  wakeat = -1;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -45,6 +54,12 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // this hart no longer uses the user page table's
+  // TLB entries; see tlbflush().
+  struct cpu *c = mycpu();
+  c->ntrap++;
+  c->umm = 0;
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -67,6 +82,11 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p, r_stval(), r_scause() == 15 ? PTE_W :
+                    r_scause() == 12 ? PTE_X : PTE_R, 1) == 0){
+    // page fault on a lazily allocated, file-backed,
+    // or copy-on-write page.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,8 +96,9 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt
+  // and the process has run for long enough.
+  if(which_dev == 2 && timeslice())
     yield();
 
   usertrapret();
@@ -118,14 +139,19 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // and its address-space identifier. from here on, other
+  // threads that change the page table wait for this hart
+  // to trap back in; see tlbflush().
+  mycpu()->umm = p->mm;
+  __sync_synchronize();
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(uvmasid(p));
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(UTRAPFRAME(p->slot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -149,8 +175,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this is a timer interrupt
+  // and the process has run for long enough.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && timeslice())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -159,15 +186,73 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date, and wake sleep()ers if one
+// is due.
 void
 clockintr()
 {
+  uint64 now = r_time();
+
+  if(now / TICKCYCLES == ticks && now < wakeat)
+    return;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  ticks = now / TICKCYCLES;
+  if(now >= wakeat){
+    // the sleepers set it again if they are not done.
+    wakeat = -1;
+    wakeup(&ticks);
+  }
   release(&tickslock);
 }
 
+// Arm this hart's timer for its next tick at time tick, in
+// timer cycles, or for its earliest sleep_ns() deadline if
+// that comes first. Caller must have interrupts off.
+void
+timerset(uint64 tick)
+{
+  struct cpu *c = mycpu();
+  uint64 when = tick;
+
+  if(timernext() < when)
+    when = timernext();
+  c->tick = tick;
+  c->timer = when;
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Send hart id a software interrupt.
+void
+ipi(int id)
+{
+  *(uint32*)CLINT_MSIP(id) = 1;
+}
+
+// A software interrupt: this hart's timer went off, or
+// another hart sent an IPI. Returns 2 if it was time for
+// the hart's tick, 1 otherwise.
+static int
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+
+  if(now < c->timer){
+    c->nipi++;
+    return 1;
+  }
+  c->ntimer++;
+  timerexpire();
+  if(now < c->tick){
+    // only a sleep_ns() deadline.
+    timerset(c->tick);
+    return 1;
+  }
+  clockintr();
+  timerset(now + TICKCYCLES);
+  return 2;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -201,18 +286,17 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
+    // the SSIP bit in sip. timervec may set it again at
+    // any moment, and disarms the timer when it does, so
+    // clear it atomically: a lost timer interrupt would
+    // leave this hart's timer disarmed for good.
+    c_sip(2);
 
-    return 2;
+    return timerintr();
   } else {
     return 0;
   }
@@ -5,28 +5,111 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "file.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// Address-space identifiers. Each user page table runs with
+// its own ASID in satp, and the kernel's with ASID 0, so the
+// TLB can hold entries of several address spaces at once and
+// trampoline.S need not flush it on every trap and return.
+//
+// ASIDs are handed out in generations. When a generation's
+// ASIDs run out, a new generation starts: each process gets
+// a new ASID when it next returns to user space, and each
+// hart flushes its whole TLB before it first uses an ASID of
+// the new generation. See uvmasid() and tlbflush().
+struct {
+  struct spinlock lock;
+  uint nasid;       // ASIDs the hardware implements; < 2 if none
+  uint next;        // next free ASID of this generation
+  uint64 gen;       // current generation, starting at 1
+} asids;
+
+// Changes to the kernel page table after boot: only the
+// mapping of kernel stacks, and their removal. The lock
+// serializes the creation of page-table pages; removal
+// doesn't need it, since kalloc() may remove stacks to
+// make room while kvmstack() holds it.
+struct {
+  struct spinlock lock;
+  uint gen;         // changes made; see kvmsync()
+} kvm;
+
+static int ufault(pagetable_t, uint64, int, int);
+static pte_t *walklevel(pagetable_t, uint64, int, int, int*);
+static void tlbflush(pagetable_t);
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Count the page-table pages, megapages and pages
+// of a page table.
+static void
+ptcount(pagetable_t pagetable, int level, int *npt, int *nmega, int *npage)
+{
+  (*npt)++;
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte)){
+      if(level == 1)
+        (*nmega)++;
+      else if(level == 0)
+        (*npage)++;
+    } else {
+      ptcount((pagetable_t)PTE2PA(pte), level - 1, npt, nmega, npage);
+    }
+  }
+}
+
+// Describe the page-table footprint of the kernel and of
+// the calling process for the statistics device.
+int
+vmstats(char *buf, int sz)
+{
+  struct proc *p = myproc();
+  int n = 0, npt, nmega, npage;
+
+  n += snprintf(buf+n, sz-n, "--- asids: %d, generation %d\n",
+                asids.nasid, asids.gen);
+  n += snprintf(buf+n, sz-n, "--- page tables\n");
+  npt = nmega = npage = 0;
+  ptcount(kernel_pagetable, 2, &npt, &nmega, &npage);
+  n += snprintf(buf+n, sz-n, "kernel: %d page-table pages, %d megapages, %d pages\n",
+                npt, nmega, npage);
+  if(p){
+    npt = nmega = npage = 0;
+    ptcount(p->pagetable, 2, &npt, &nmega, &npage);
+    n += snprintf(buf+n, sz-n, "pid %d: %d page-table pages, %d megapages, %d pages\n",
+                  p->pid, npt, nmega, npage);
+  }
+  return n;
+}
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for timerset() and ipi()
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -43,8 +126,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
+  // kernel stacks are mapped as processes are created;
+  // see kvmstack().
   
   return kpgtbl;
 }
@@ -54,6 +137,10 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&kvm.lock, "kvm");
+  initlock(&asids.lock, "asids");
+  asids.next = 1;
+  asids.gen = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,10 +148,108 @@ kvminit(void)
 void
 kvminithart()
 {
+  // find out how many ASIDs there are: the ASID bits
+  // the hardware doesn't implement read back as zero.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+  if(cpuid() == 0)
+    asids.nasid = SATP2ASID(r_satp()) + 1;
+
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
+// Return the ASID that process p should run with on this
+// hart, first giving p's address space a new one if its own
+// is from an old generation, and flushing this hart's TLB
+// if it may hold stale entries for that ASID. Called by
+// usertrapret() with interrupts off.
+uint64
+uvmasid(struct proc *p)
+{
+  struct mm *mm = p->mm;
+  struct cpu *c = mycpu();
+  uint mask = 1 << cpuid();
+  uint64 gen;
+
+  if(asids.nasid < 2)
+    return 0;   // trampoline.S flushes on every switch.
+
+  gen = asids.gen;
+  if(mm->asidgen != gen){
+    // another thread of mm may be doing the same.
+    acquire(&asids.lock);
+    if(mm->asidgen != asids.gen){
+      if(asids.next == asids.nasid){
+        asids.gen++;
+        asids.next = 1;
+      }
+      mm->asid = asids.next++;
+      mm->tlbstale = 0;
+      mm->asidgen = asids.gen;
+    }
+    gen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if(c->asidgen != gen){
+    // entries of the old generation's ASIDs may linger.
+    sfence_vma();
+    c->asidgen = gen;
+    __sync_fetch_and_and(&mm->tlbstale, ~mask);
+  } else if(__sync_fetch_and_and(&mm->tlbstale, ~mask) & mask){
+    sfence_vma_asid(mm->asid);
+  }
+  return mm->asid;
+}
+
+// Some mappings of pagetable were removed or changed.
+// If it is the current process's, drop its TLB entries
+// on this hart, and have every other hart drop them
+// before it next runs the address space. Any other page
+// table is not in use, and gets a fresh ASID when it is.
+//
+// Other threads may be running in user space on other
+// harts meanwhile, with the old mappings in their TLBs.
+// Send each such hart an IPI and wait until it has trapped
+// into the kernel: it flushes on its way back out, in
+// uvmasid(). Pages must not be freed until then; see
+// uvmunmap().
+static void
+tlbflush(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+  uint ntrap[NCPU];
+  struct mm *mm;
+  int id;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  mm = p->mm;
+  push_off();
+  id = cpuid();
+  if(asids.nasid >= 2){
+    sfence_vma_asid(mm->asid);
+    __sync_fetch_and_or(&mm->tlbstale, ~(1 << id));
+  }
+  if(mm->nlive > 1){
+    // pairs with the fence in usertrapret().
+    __sync_synchronize();
+    for(int i = 0; i < NCPU; i++){
+      ntrap[i] = cpus[i].ntrap;
+      if(i != id && cpus[i].umm == mm)
+        ipi(i);
+    }
+    for(int i = 0; i < NCPU; i++){
+      if(i == id)
+        continue;
+      while(*(struct mm * volatile *)&cpus[i].umm == mm &&
+            *(volatile uint *)&cpus[i].ntrap == ntrap[i])
+        ;
+    }
+  }
+  pop_off();
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -77,24 +262,71 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid level-1 PTE with any of R, W or X set is a leaf
+// that maps a whole 2-megabyte megapage; walk() returns it
+// if va lies in one. Use walklevel() to tell the two apart.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level;
+
+  return walklevel(pagetable, va, alloc, 0, &level);
+}
+
+// Like walk(), but stop at the level-stop PTE for va
+// (0 for a page, 1 for a megapage), or at a megapage
+// leaf on the way. Sets *level to the level of the
+// returned PTE.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int stop, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(*level = 2; *level > stop; (*level)--) {
+    pte_t *pte = &pagetable[PX(*level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
+}
+
+// The physical address of the page holding va,
+// given va's leaf PTE at level.
+static uint64
+pteaddr(pte_t pte, int level, uint64 va)
+{
+  if(level == 1)
+    return PTE2PA(pte) + (PGROUNDDOWN(va) & (MEGAPGSIZE-1));
+  return PTE2PA(pte);
+}
+
+// Split the megapage mapped by leaf *pte into 512 page
+// mappings with the same permissions, so that they can
+// be changed one at a time. The physical pages keep
+// their own reference counts; see kalloc_pages().
+// returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if((pt = kalloc_zeroed()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -105,18 +337,21 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  pte = walklevel(pagetable, va, 0, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // maybe a heap page that has not been touched yet.
+    if(ufault(pagetable, va, 0, 1) != 0)
+      return 0;
+    pte = walklevel(pagetable, va, 0, 0, &level);
+  }
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, level, va);
   return pa;
 }
 
@@ -130,15 +365,77 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// Map a fresh page as the kernel stack at va, unless
+// one is mapped there already. The page below va is never
+// mapped, so it catches stack overflows.
+// returns 0 on success, -1 if out of memory.
+int
+kvmstack(uint64 va)
+{
+  pte_t *pte;
+  char *pa;
+
+  if((pte = walk(kernel_pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return 0;
+  if((pa = kalloc()) == 0)
+    return -1;
+  acquire(&kvm.lock);
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0){
+    release(&kvm.lock);
+    kfree(pa);
+    return -1;
+  }
+  release(&kvm.lock);
+  __sync_fetch_and_add(&kvm.gen, 1);
+  return 0;
+}
+
+// Unmap and free the kernel stack page at va,
+// which no process is using.
+// returns the number of pages freed.
+int
+kvmunstack(uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  pa = PTE2PA(*pte);
+  *pte = 0;
+  __sync_fetch_and_add(&kvm.gen, 1);
+  kfree((void*)pa);
+  return 1;
+}
+
+// A hart may cache a kernel stack's old mapping, or its
+// absence, in its TLB until it flushes. scheduler() calls
+// this before it switches to a process, so that the
+// process's stack is always the one now mapped.
+void
+kvmsync(void)
+{
+  struct cpu *c = mycpu();
+  uint gen = kvm.gen;
+
+  if(c->kvmgen != gen){
+    sfence_vma_asid(0);
+    c->kvmgen = gen;
+  }
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Uses a megapage wherever va and pa are both
+// 2-megabyte aligned and at least 2 megabytes remain.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, step;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -146,44 +443,85 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if((a % MEGAPGSIZE) == 0 && (pa % MEGAPGSIZE) == 0 &&
+       last - a >= MEGAPGSIZE - PGSIZE)
+      step = MEGAPGSIZE;
+    else
+      step = PGSIZE;
+    if((pte = walklevel(pagetable, a, 1, step == MEGAPGSIZE, &level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a + step - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += step;
+    pa += step;
   }
   return 0;
 }
 
+// Pages that uvmunmap() has unmapped, to be freed once no
+// TLB can hold them any longer. A megapage is marked
+// with its low bit.
+#define NUNMAP 32
+
+static void
+unmapfree(pagetable_t pagetable, uint64 *pa, int n)
+{
+  tlbflush(pagetable);
+  for(int i = 0; i < n; i++){
+    if(pa[i] & 1){
+      for(int j = 0; j < 512; j++)
+        kfree((void*)((pa[i] & ~1L) + j*PGSIZE));
+    } else {
+      kfree((void*)pa[i]);
+    }
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end, freed[NUNMAP];
+  int level, nfreed = 0;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    // user memory is allocated lazily, so
+    // there may be holes; see vmfault().
+    if((pte = walklevel(pagetable, a, 0, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1 && ((a % MEGAPGSIZE) != 0 || end - a < MEGAPGSIZE)){
+      // unmapping part of a megapage.
+      if(demote(pte) != 0)
+        panic("uvmunmap: demote");
+      a -= PGSIZE;
+      continue;
+    }
     if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(nfreed == NUNMAP){
+        unmapfree(pagetable, freed, nfreed);
+        nfreed = 0;
+      }
+      freed[nfreed++] = PTE2PA(*pte) | (level == 1);
     }
     *pte = 0;
+    if(level == 1)
+      a += MEGAPGSIZE - PGSIZE;
   }
+  unmapfree(pagetable, freed, nfreed);
 }
 
 // create an empty user page table.
@@ -192,10 +530,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -209,8 +546,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -228,12 +564,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -293,8 +628,10 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table but not the physical
+// memory: both page tables share each page,
+// and writable pages become read-only
+// copy-on-write pages in both; see cowfault().
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -303,30 +640,637 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+    if((pte = walklevel(old, i, 0, 0, &level)) == 0)
+      continue;   // never touched; see vmfault()
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(level == 1){
+      // share megapages one page at a time.
+      if(demote(pte) != 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kref((void*)pa);
   }
+  tlbflush(old);
   return 0;
 
  err:
+  tlbflush(old);
   uvmunmap(new, 0, i / PGSIZE, 1);
   return -1;
 }
 
+// Handle a write to the copy-on-write page at va:
+// give pagetable a private, writable copy of the page,
+// or just make the page writable if no one else
+// shares it any longer.
+// returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory for the copy.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    tlbflush(pagetable);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  tlbflush(pagetable);
+  futexmoved(pa);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Return p's memory region that holds va, or 0.
+// Caller must hold p->mm->lock or maplock.
+static struct vma *
+vmalookup(struct proc *p, uint64 va)
+{
+  for(struct vma *v = p->mm->vma; v < &p->mm->vma[NVMA]; v++)
+    if(v->end && va >= v->va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Map the page at va of region v. File pages are read
+// through the page cache and shared with every other
+// process mapping the same file; in a writable private
+// region they are mapped copy-on-write.
+// Called with p->mm->lock held. Reading the file sleeps,
+// so it also needs maplock, under which vmafault() lets go
+// of mm->lock meanwhile: returns 1 if maplock is needed
+// but maplocked is 0.
+static int
+vmafault(struct proc *p, struct vma *v, uint64 va, int write, int maplocked)
+{
+  struct mm *mm = p->mm;
+  uint64 o = va - v->va;
+  uint flags = v->perm | PTE_U;
+  char *mem;
+
+  if((v->perm & (PTE_R|PTE_W|PTE_X)) == 0)
+    return -1;
+  if(write && (v->perm & PTE_W) == 0)
+    return -1;
+
+  if(v->ip == 0 || o >= v->filesz){
+    // anonymous memory or bss: nothing to share.
+    mem = kalloc_zeroed();
+  } else {
+    if(!maplocked)
+      return 1;
+    // v can't change while maplock is held, and no other
+    // thread can map this page meanwhile, since that
+    // needs maplock too.
+    uint n = v->filesz - o < PGSIZE ? v->filesz - o : PGSIZE;
+    release(&mm->lock);
+    mem = pcache_get(v->ip, v->off + o, n);
+    acquire(&mm->lock);
+    if((flags & PTE_W) && (v->flags & MAP_SHARED) == 0)
+      flags = (flags & ~PTE_W) | PTE_COW;
+  }
+  if(mem == 0)
+    return -1;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, flags) != 0){
+    kfree(mem);
+    return -1;
+  }
+  if(write && (flags & PTE_COW))
+    return cowfault(p->pagetable, va);
+  return 0;
+}
+
+// Heap pages of a 2-megabyte block that must be in use
+// before promote() maps the block with a megapage, so that
+// a sparse heap does not pay for whole megapages.
+#define MEGADENSE 256
+
+// Map the 2-megabyte block of heap around va with one
+// megapage instead of its pages, if the whole block lies
+// below mm->sz, no region overlaps it, and at least
+// MEGADENSE of its pages are mapped, each private to the
+// process and not pinned by a system call. A big heap then
+// needs fewer page-table pages and TLB entries.
+// Caller must hold p->mm->lock.
+static void
+promote(struct proc *p, uint64 va)
+{
+  uint64 base = va & ~(MEGAPGSIZE-1);
+  int heap = PTE_W|PTE_X|PTE_R|PTE_U;
+  pagetable_t pt;
+  pte_t *pte;
+  char *mem;
+  int i, n, level;
+
+  if(base + MEGAPGSIZE > p->mm->sz || base + MEGAPGSIZE > MAXVA ||
+     vmaoverlap(p, base, base + MEGAPGSIZE))
+    return;
+  pte = walklevel(p->pagetable, base, 0, 1, &level);
+  if(pte == 0 || level != 1 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return;
+  pt = (pagetable_t)PTE2PA(*pte);
+  n = 0;
+  for(i = 0; i < 512; i++){
+    if((pt[i] & PTE_V) == 0)
+      continue;
+    if((pt[i] & (heap|PTE_COW)) != heap || krefcnt((void*)PTE2PA(pt[i])) != 1)
+      return;
+    n++;
+  }
+  if(n < MEGADENSE || (mem = kalloc_pages(9)) == 0)
+    return;
+
+  // unmap the block first, so that no other thread can
+  // store to the old pages while they are copied; their
+  // faults wait for mm->lock.
+  *pte = 0;
+  tlbflush(p->pagetable);
+  for(i = 0; i < 512; i++){
+    if(pt[i] & PTE_V){
+      memmove(mem + i*PGSIZE, (void*)PTE2PA(pt[i]), PGSIZE);
+      kfree((void*)PTE2PA(pt[i]));
+    } else {
+      memset(mem + i*PGSIZE, 0, PGSIZE);
+    }
+  }
+  kfree(pt);
+  *pte = PA2PTE(mem) | heap | PTE_V;
+}
+
+// vmfault() with p->mm->lock held.
+static int
+pgfault(struct proc *p, uint64 va, int access, int maplocked)
+{
+  pagetable_t pagetable = p->pagetable;
+  int write = access == PTE_W;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) && (*pte & access)){
+      // the TLB held the PTE from before it was made
+      // valid or writable, which trampoline.S no
+      // longer flushes; see uvmasid(). Or another
+      // thread has just faulted the page in.
+      sfence_vma_asid(p->mm->asid);
+      return 0;
+    }
+    if(write && (*pte & PTE_COW))
+      return cowfault(pagetable, va);
+    return -1;
+  }
+
+  if((v = vmalookup(p, va)) != 0)
+    return vmafault(p, v, va, write, maplocked);
+  if(va >= p->mm->sz)
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  promote(p, va);
+  return 0;
+}
+
+// Handle a page fault at va in process p.
+// Heap pages are allocated lazily: sbrk() only moves
+// mm->sz, and the first touch of a page maps a zero-filled
+// one here. Pages of program segments and mmap() regions
+// are filled by vmafault(). A store to a copy-on-write
+// page goes to cowfault(). access is PTE_R, PTE_W or PTE_X
+// for a load, store or instruction fetch. maysleep is
+// 0 if the caller holds a spinlock, as when copyin() or
+// copyout() runs under one, and so may not read a file.
+// returns 0 if the fault was handled, -1 if it was
+// a genuine fault or there is no memory.
+int
+vmfault(struct proc *p, uint64 va, int access, int maysleep)
+{
+  struct mm *mm = p->mm;
+  int r;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return -1;
+  acquire(&mm->lock);
+  r = pgfault(p, va, access, 0);
+  release(&mm->lock);
+  if(r != 1)
+    return r;
+
+  // a page of a file. reading it may sleep; callers that
+  // hold a spinlock fault such pages in beforehand with
+  // vmaprefault().
+  if(!maysleep)
+    return -1;
+  acquiresleep(&mm->maplock);
+  acquire(&mm->lock);
+  r = pgfault(p, va, access, 1);
+  release(&mm->lock);
+  releasesleep(&mm->maplock);
+  return r;
+}
+
+// A system call found no usable page at va in
+// pagetable; fault it in as usertrap() would, if
+// pagetable belongs to the current process.
+static int
+ufault(pagetable_t pagetable, uint64 va, int write, int maysleep)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return -1;
+  return vmfault(p, va, write ? PTE_W : PTE_R, maysleep);
+}
+
+// Fault in the region pages of the current process
+// between va and va+n, so that a system call can copy to
+// or from them while holding a lock. Errors are left for
+// copyin()/copyout() to report.
+void
+vmaprefault(uint64 va, uint64 n, int write)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  uint64 a, last;
+  pte_t *pte;
+  int fault;
+
+  if(n == 0 || va + n < va)
+    return;
+  last = PGROUNDDOWN(va + n - 1);
+  for(a = PGROUNDDOWN(va); a <= last && a < MAXVA; a += PGSIZE){
+    acquire(&mm->lock);
+    struct vma *v = vmalookup(p, a);
+    if(v == 0){
+      // skip to the next region that starts above a.
+      uint64 next = last + PGSIZE;
+      for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+        if(v->end && v->va > a && v->va < next)
+          next = v->va;
+      release(&mm->lock);
+      a = next - PGSIZE;
+      continue;
+    }
+    pte = walk(p->pagetable, a, 0);
+    fault = pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW));
+    release(&mm->lock);
+    if(fault)
+      vmfault(p, a, write ? PTE_W : PTE_R, 1);
+  }
+}
+
+// Does [start, end) overlap one of p's regions?
+// Caller must hold p->mm->lock.
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  for(struct vma *v = p->mm->vma; v < &p->mm->vma[NVMA]; v++)
+    if(v->end && v->va < end && PGROUNDUP(v->end) > start)
+      return 1;
+  return 0;
+}
+
+// Give np copies of p's regions, for fork(). Pages below
+// mm->sz are left to uvmcopy(); mapped pages above it are
+// shared with np: MAP_SHARED pages as they are, private
+// writable pages copy-on-write.
+// Caller must hold p->mm->lock.
+// returns 0 on success, -1 on failure.
+int
+vmadup(struct proc *p, struct proc *np)
+{
+  struct mm *mm = p->mm;
+  struct vma *v;
+  uint64 a;
+  pte_t *pte;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    a = v->va > PGROUNDUP(mm->sz) ? v->va : PGROUNDUP(mm->sz);
+    for(; a < PGROUNDUP(v->end); a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if((*pte & PTE_W) && (v->flags & MAP_SHARED) == 0)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      if(mappages(np->pagetable, a, PGSIZE, PTE2PA(*pte), PTE_FLAGS(*pte)) != 0)
+        goto bad;
+      kref((void*)PTE2PA(*pte));
+    }
+  }
+  tlbflush(p->pagetable);
+
+  for(int i = 0; i < NVMA; i++){
+    np->mm->vma[i] = mm->vma[i];
+    if(np->mm->vma[i].ip)
+      idup(np->mm->vma[i].ip);
+  }
+  return 0;
+
+ bad:
+  tlbflush(p->pagetable);
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->end == 0 || PGROUNDUP(v->end) <= PGROUNDUP(mm->sz))
+      continue;
+    a = v->va > PGROUNDUP(mm->sz) ? v->va : PGROUNDUP(mm->sz);
+    uvmunmap(np->pagetable, a, (PGROUNDUP(v->end) - a) / PGSIZE, 1);
+  }
+  return -1;
+}
+
+// Write the pages of a shared file mapping that have been
+// stored to since they were mapped back to the file.
+// Does not extend the file.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, pa, o;
+  uint i, n, m;
+  pte_t *pte;
+
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+    o = a - v->va;
+    if(o >= v->filesz)
+      continue;
+    n = v->filesz - o < PGSIZE ? v->filesz - o : PGSIZE;
+    pa = PTE2PA(*pte);
+    // write a few blocks at a time, as filewrite() does,
+    // to stay within a transaction's log budget.
+    for(i = 0; i < n; i += m){
+      m = n - i < max ? n - i : max;
+      begin_op();
+      ilock(v->ip);
+      if(v->off + o + i + m <= v->ip->size)
+        writei(v->ip, 0, pa + i, v->off + o + i, m);
+      iunlock(v->ip);
+      end_op();
+    }
+  }
+}
+
+// Unmap the pages of region v between start and end,
+// writing them back first if v is a shared file mapping.
+// No region may cover them any longer, except in a
+// process with no other threads, so that no fault can
+// map them again meanwhile.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  if(v->ip && (v->flags & MAP_SHARED) && (v->perm & PTE_W))
+    vmawriteback(p, v, start, end);
+  acquire(&p->mm->lock);
+  uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+  release(&p->mm->lock);
+}
+
+// Forget the first n bytes of region v.
+static void
+vmatrim(struct vma *v, uint64 n)
+{
+  v->va += n;
+  v->off += n;
+  v->filesz = v->filesz > n ? v->filesz - n : 0;
+}
+
+// Drop region v and its reference to the file, if any.
+static void
+vmadrop(struct vma *v)
+{
+  if(v->ip){
+    begin_op();
+    iput(v->ip);
+    end_op();
+  }
+  v->ip = 0;
+  v->end = 0;
+}
+
+// Unmap and drop all of p's regions, writing back shared
+// file mappings. Must not be called inside a transaction,
+// or while other threads use p's address space.
+void
+vmafree(struct proc *p)
+{
+  for(struct vma *v = p->mm->vma; v < &p->mm->vma[NVMA]; v++){
+    if(v->end){
+      vmaunmap(p, v, v->va, PGROUNDUP(v->end));
+      vmadrop(v);
+    }
+  }
+}
+
+// Find len bytes of unused address space for a mapping,
+// as high as possible below the trapframes and above
+// the heap. Returns 0 if there is no room.
+// Caller must hold p->mm->lock.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct mm *mm = p->mm;
+  uint64 end = USERTOP, start;
+  struct vma *v;
+
+  for(;;){
+    if(end < len || end - len < PGROUNDUP(mm->sz))
+      return 0;
+    start = end - len;
+    for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+      if(v->end && v->va < end && PGROUNDUP(v->end) > start)
+        break;
+    if(v == &mm->vma[NVMA])
+      return start;
+    end = v->va;
+  }
+}
+
+// Map len bytes of f from offset off (or zeros, if f is 0)
+// into the current process with permissions prot.
+// flags is MAP_SHARED or MAP_PRIVATE, maybe with
+// MAP_ANONYMOUS. Pages are filled on first touch.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v;
+  uint64 va, a;
+  uint filesz = 0;
+  int perm = 0;
+
+  if(len == 0 || len > MAXVA || (off % PGSIZE) != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) != MAP_SHARED &&
+     (flags & (MAP_SHARED|MAP_PRIVATE)) != MAP_PRIVATE)
+    return -1;
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+  } else {
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (perm & PTE_W) && !f->writable)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+  if(f){
+    ilock(f->ip);
+    if(f->ip->size > off)
+      filesz = f->ip->size - off < len ? f->ip->size - off : len;
+    iunlock(f->ip);
+  }
+
+  acquiresleep(&mm->maplock);
+  acquire(&mm->lock);
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->end == 0)
+      break;
+  if(v == &mm->vma[NVMA] || (va = vmaplace(p, len)) == 0){
+    release(&mm->lock);
+    releasesleep(&mm->maplock);
+    return -1;
+  }
+
+  v->va = va;
+  v->end = va + len;
+  v->perm = perm;
+  v->flags = flags;
+  v->off = off;
+  v->ip = f ? idup(f->ip) : 0;
+  v->filesz = filesz;
+  if(f == 0 && (flags & MAP_SHARED) && perm){
+    // there is no file to share through, so populate
+    // now, so that fork() children share every page.
+    for(a = va; a < va + len; a += PGSIZE){
+      if(vmafault(p, v, a, 0, 0) != 0){
+        uvmunmap(p->pagetable, va, (a - va) / PGSIZE, 1);
+        v->end = 0;
+        va = -1;
+        break;
+      }
+    }
+  }
+  release(&mm->lock);
+  releasesleep(&mm->maplock);
+  return va;
+}
+
+// Unmap [addr, addr+len) from the current process.
+// Returns 0 on success, -1 on failure.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v, *w = 0, old;
+  uint64 end, s, e;
+
+  if((addr % PGSIZE) != 0 || len == 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+
+  // regions only change with maplock held, so each one
+  // can be looked at without mm->lock. A region is cut
+  // back before its pages are written back and unmapped,
+  // so that other threads can't fault them in again.
+  acquiresleep(&mm->maplock);
+
+  // a region that reaches past both ends of the range is
+  // split in two, which needs a free slot. find it before
+  // changing anything, so that a failed munmap() has no
+  // effect.
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->end && v->va < addr && PGROUNDUP(v->end) > end){
+      for(w = mm->vma; w < &mm->vma[NVMA]; w++)
+        if(w->end == 0)
+          break;
+      if(w == &mm->vma[NVMA]){
+        releasesleep(&mm->maplock);
+        return -1;
+      }
+    }
+  }
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->end == 0 || v->va >= end || PGROUNDUP(v->end) <= addr)
+      continue;
+    s = v->va > addr ? v->va : addr;
+    e = PGROUNDUP(v->end) < end ? PGROUNDUP(v->end) : end;
+
+    acquire(&mm->lock);
+    old = *v;
+    if(s == v->va && e == PGROUNDUP(v->end)){
+      v->end = 0;
+      v->ip = 0;
+    } else if(s == v->va){
+      vmatrim(v, e - v->va);
+    } else if(e == PGROUNDUP(v->end)){
+      v->end = s;
+      if(v->filesz > s - v->va)
+        v->filesz = s - v->va;
+    } else {
+      // a hole in the middle: split v in two, into the
+      // slot w found above.
+      *w = *v;
+      vmatrim(w, e - w->va);
+      if(w->ip)
+        idup(w->ip);
+      v->end = s;
+      if(v->filesz > s - v->va)
+        v->filesz = s - v->va;
+    }
+    release(&mm->lock);
+
+    vmaunmap(p, &old, s, e);
+    if(v->end == 0)
+      vmadrop(&old);
+  }
+  releasesleep(&mm->maplock);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -340,23 +1284,70 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the physical address of the user page at va in
+// pagetable, faulting it in if need be, and with a reference
+// held, so that another thread of the process can't unmap
+// and free it while a system call copies to or from it, or
+// waits on it in futex_wait(). kfree() drops the reference.
+// A store (write) needs a writable page, so it breaks
+// copy-on-write. maysleep is as for vmfault().
+// Returns 0 if there is no such page.
+uint64
+uvmpin(pagetable_t pagetable, uint64 va, int write, int maysleep)
+{
+  struct proc *p = myproc();
+  int need = PTE_V | PTE_U | (write ? PTE_W : 0);
+  struct mm *mm = 0;
+  uint64 pa = 0;
+  pte_t *pte;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+  if(p && p->pagetable == pagetable)
+    mm = p->mm;
+  if(mm)
+    acquire(&mm->lock);
+  pte = walklevel(pagetable, va, 0, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // maybe a heap page that has not been touched yet.
+    if(mm)
+      release(&mm->lock);
+    if(ufault(pagetable, va, write, maysleep) != 0)
+      return 0;
+    if(mm)
+      acquire(&mm->lock);
+    pte = walklevel(pagetable, va, 0, 0, &level);
+  }
+  if(pte && write && (*pte & PTE_COW))
+    cowfault(pagetable, va);
+  if(pte && (*pte & need) == need){
+    pa = pteaddr(*pte, level, va);
+    kref((void*)pa);
+  }
+  if(mm)
+    release(&mm->lock);
+  return pa;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// maysleep is as for vmfault().
 // Return 0 on success, -1 on error.
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+static int
+copyout1(pagetable_t pagetable, uint64 dstva, char *src, uint64 len, int maysleep)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpin(pagetable, va0, 1, maysleep)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    kfree((void*)pa0);
 
     len -= n;
     src += n;
@@ -365,23 +1356,37 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
+int
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  return copyout1(pagetable, dstva, src, len, 1);
+}
+
+// copyout() for a caller holding a spinlock.
+int
+copyout_locked(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  return copyout1(pagetable, dstva, src, len, 0);
+}
+
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
+// maysleep is as for vmfault().
 // Return 0 on success, -1 on error.
-int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+static int
+copyin1(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len, int maysleep)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpin(pagetable, va0, 0, maysleep)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    kfree((void*)pa0);
 
     len -= n;
     dst += n;
@@ -390,6 +1395,19 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  return copyin1(pagetable, dst, srcva, len, 1);
+}
+
+// copyin() for a caller holding a spinlock.
+int
+copyin_locked(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  return copyin1(pagetable, dst, srcva, len, 0);
+}
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -402,8 +1420,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpin(pagetable, va0, 0, 1)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -423,6 +1440,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    kfree((void*)pa0);
 
     srcva = va0 + PGSIZE;
   }
@@ -0,0 +1,59 @@
+//
+// page allocator benchmark: fork/exit throughput with 1, 2,
+// 4 and 8 concurrent forkers, to show how kalloc() scales
+// across harts. Run with make CPUS=8 to see all four
+// points, and stats after it for the per-hart counters.
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define N 100   // fork/exits per forker
+
+int nworkers[] = { 1, 2, 4, 8 };
+
+// fork w forkers, each doing N fork/exits, and return the
+// ticks taken.
+int
+forkers(int w)
+{
+  int xstatus;
+
+  int t0 = uptime();
+  for(int i = 0; i < w; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("allocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < N; j++){
+        int pid1 = fork();
+        if(pid1 < 0)
+          exit(1);
+        if(pid1 == 0)
+          exit(0);
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+  for(int i = 0; i < w; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("allocbench: fork in forker failed\n");
+      exit(1);
+    }
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int k = 0; k < sizeof(nworkers)/sizeof(nworkers[0]); k++){
+    int w = nworkers[k];
+    printf("%d forkers: %d fork/exit in %d ticks\n", w, w*N, forkers(w));
+  }
+  exit(0);
+}
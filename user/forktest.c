@@ -1,11 +1,15 @@
 // Test that fork fails gracefully.
-// Tiny executable so that the limit can be filling the proc table.
+// There is no fixed limit on the number of processes,
+// so this forks until memory runs out: fork() must then
+// return -1, and everything else that runs out of memory
+// meanwhile (inodes, page tables, kernel stacks) must fail
+// its system call rather than panic.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-#define N  1000
+#define N  100000
 
 void
 print(const char *s)
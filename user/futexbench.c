@@ -0,0 +1,143 @@
+//
+// futex benchmarks: the cost of an uncontended mutex, a
+// counter shared by several threads under one mutex, and
+// handing a turn back and forth between two threads, first
+// through a pair of pipes and then with a mutex and a
+// condition variable.
+//
+// usage: futexbench [nthread]
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NLOCK   1000000
+#define NINCR   100000
+#define ROUNDS  10000
+#define MAXT    8
+
+struct mutex lock;
+struct cond turned;
+int counter;
+int turn;
+int fds[2][2];
+
+void
+incr(void *a)
+{
+  for(int i = 0; i < NINCR; i++){
+    mutex_lock(&lock);
+    counter++;
+    mutex_unlock(&lock);
+  }
+}
+
+void
+counterbench(int n)
+{
+  int tids[MAXT];
+
+  counter = 0;
+  int t0 = uptime();
+  for(int i = 0; i < n; i++){
+    if((tids[i] = thread_create(incr, 0)) < 0){
+      printf("futexbench: thread_create failed\n");
+      exit(1);
+    }
+  }
+  for(int i = 0; i < n; i++)
+    thread_join(tids[i], 0);
+  int t1 = uptime();
+  if(counter != n * NINCR){
+    printf("futexbench: counter %d, not %d\n", counter, n * NINCR);
+    exit(1);
+  }
+  printf("counter: %d threads, %d increments each: %d ticks\n", n, NINCR, t1 - t0);
+}
+
+void
+pipeside(void *a)
+{
+  char c;
+
+  for(int i = 0; i < ROUNDS; i++){
+    if(read(fds[0][0], &c, 1) != 1 || write(fds[1][1], &c, 1) != 1)
+      exit(1);
+  }
+}
+
+void
+condside(void *a)
+{
+  mutex_lock(&lock);
+  for(int i = 0; i < ROUNDS; i++){
+    while(turn != 1)
+      cond_wait(&turned, &lock);
+    turn = 0;
+    cond_signal(&turned);
+  }
+  mutex_unlock(&lock);
+}
+
+void
+handoffbench(void)
+{
+  char c = 0;
+  int tid;
+
+  if(pipe(fds[0]) < 0 || pipe(fds[1]) < 0){
+    printf("futexbench: pipe failed\n");
+    exit(1);
+  }
+  int t0 = uptime();
+  if((tid = thread_create(pipeside, 0)) < 0){
+    printf("futexbench: thread_create failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < ROUNDS; i++){
+    if(write(fds[0][1], &c, 1) != 1 || read(fds[1][0], &c, 1) != 1){
+      printf("futexbench: pipe handoff failed\n");
+      exit(1);
+    }
+  }
+  thread_join(tid, 0);
+  int t1 = uptime();
+  printf("handoff: %d round trips through pipes: %d ticks\n", ROUNDS, t1 - t0);
+
+  turn = 0;
+  if((tid = thread_create(condside, 0)) < 0){
+    printf("futexbench: thread_create failed\n");
+    exit(1);
+  }
+  mutex_lock(&lock);
+  for(int i = 0; i < ROUNDS; i++){
+    turn = 1;
+    cond_signal(&turned);
+    while(turn != 0)
+      cond_wait(&turned, &lock);
+  }
+  mutex_unlock(&lock);
+  thread_join(tid, 0);
+  printf("handoff: %d round trips with a condition variable: %d ticks\n",
+         ROUNDS, uptime() - t1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = argc > 1 ? atoi(argv[1]) : 4;
+  if(n < 1 || n > MAXT)
+    n = 4;
+
+  int t0 = uptime();
+  for(int i = 0; i < NLOCK; i++){
+    mutex_lock(&lock);
+    mutex_unlock(&lock);
+  }
+  printf("uncontended: %d lock/unlock pairs: %d ticks\n", NLOCK, uptime() - t0);
+
+  counterbench(1);
+  counterbench(n);
+  handoffbench();
+  exit(0);
+}
@@ -0,0 +1,85 @@
+//
+// idle benchmark: sleep for a while on an otherwise idle
+// machine, and report the timer interrupts and IPIs the
+// harts took meanwhile and how much of the time they spent
+// in wfi. Build with make TICKLESS=0 for the numbers with
+// a tick on every hart: each takes one timer interrupt per
+// tick and spins in between, so there are no wfis. With
+// tickless idle, only the timer that ends the sleep goes
+// off. Watch qemu's host CPU use (with top, say) while it
+// runs to see what the idle harts cost either way.
+//
+// usage: idlebench [ticks]
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+char stats[4096];
+
+struct idle {
+  int nhart;
+  int idle;   // sum of the harts' idle percentages
+  int wfi;
+  int timer;
+  int ipi;
+};
+
+// the number after name in line, or 0.
+int
+field(char *line, char *name)
+{
+  int n = strlen(name);
+
+  for(char *p = line; *p && *p != '\n'; p++)
+    if(memcmp(p, name, n) == 0)
+      return atoi(p + n);
+  return 0;
+}
+
+// add up the idle harts section of the statistics device.
+void
+getidle(struct idle *s)
+{
+  char *tag = "--- idle harts\n";
+  char *p;
+
+  memset(s, 0, sizeof(*s));
+  int n = statistics(stats, sizeof(stats)-1);
+  if(n < 0){
+    printf("idlebench: statistics failed\n");
+    exit(1);
+  }
+  stats[n] = 0;
+  for(p = stats; *p; p++)
+    if(memcmp(p, tag, strlen(tag)) == 0)
+      break;
+  if(*p == 0)
+    return;
+  for(p = strchr(p, '\n') + 1; memcmp(p, "hart ", 5) == 0; p = strchr(p, '\n') + 1){
+    s->nhart++;
+    s->idle += field(p, "idle ");
+    s->wfi += field(p, "wfi ");
+    s->timer += field(p, "timer ");
+    s->ipi += field(p, "ipi ");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct idle a, b;
+  int n = argc > 1 ? atoi(argv[1]) : 50;
+
+  getidle(&a);
+  sleep(n);
+  getidle(&b);
+  if(b.nhart == 0){
+    printf("idlebench: no idle statistics\n");
+    exit(1);
+  }
+  printf("%d ticks asleep, %d harts: %d timer interrupts, %d ipis, %d wfis\n",
+         n, b.nhart, b.timer - a.timer, b.ipi - a.ipi, b.wfi - a.wfi);
+  printf("harts idle %d%% of the time since boot, on average\n", b.idle / b.nhart);
+  exit(0);
+}
@@ -0,0 +1,169 @@
+//
+// tests for readv(), writev(), pread() and pwrite(), and a
+// benchmark writing records of a small header and a body,
+// each with two write()s and then with one writev().
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/uio.h"
+#include "user/user.h"
+
+#define NBUF   IOV_MAX
+#define BUFSZ  1000   // NBUF of these span several log transactions
+#define NREC   200
+#define HDRSZ  16
+#define BODYSZ 512
+
+char *file = "iovtest.tmp";
+char data[NBUF * BUFSZ];
+char back[NBUF * BUFSZ];
+
+void
+fail(char *what)
+{
+  printf("iovtest: %s failed\n", what);
+  unlink(file);
+  exit(1);
+}
+
+int
+openfile(int mode)
+{
+  int fd = open(file, mode);
+  if(fd < 0)
+    fail("open");
+  return fd;
+}
+
+// write data with one writev(), read it back with one
+// read(), and then gather it with readv() into buffers of
+// another size.
+void
+vectest(void)
+{
+  struct iovec iov[NBUF];
+
+  for(int i = 0; i < NBUF; i++){
+    iov[i].iov_base = data + i * BUFSZ;
+    iov[i].iov_len = BUFSZ;
+  }
+  iov[3].iov_len = 0;  // empty buffers are skipped
+  iov[4].iov_base = data + 3 * BUFSZ;
+  iov[4].iov_len = 2 * BUFSZ;
+
+  int fd = openfile(O_CREATE|O_TRUNC|O_WRONLY);
+  if(writev(fd, iov, NBUF) != sizeof(data))
+    fail("writev");
+  close(fd);
+
+  fd = openfile(O_RDONLY);
+  if(read(fd, back, sizeof(back)) != sizeof(back) || memcmp(data, back, sizeof(data)) != 0)
+    fail("writev data");
+  close(fd);
+
+  memset(back, 0, sizeof(back));
+  for(int i = 0; i < 4; i++){
+    iov[i].iov_base = back + i * (sizeof(back) / 4);
+    iov[i].iov_len = sizeof(back) / 4;
+  }
+  fd = openfile(O_RDONLY);
+  if(readv(fd, iov, 4) != sizeof(back) || memcmp(data, back, sizeof(data)) != 0)
+    fail("readv");
+  if(readv(fd, iov, 4) != 0)
+    fail("readv at end of file");
+  if(readv(fd, iov, NBUF + 1) != -1)
+    fail("readv of too many buffers");
+  close(fd);
+}
+
+// pread() and pwrite() at offsets, with the file's own
+// offset staying where read() and write() left it.
+void
+postest(void)
+{
+  char buf[BUFSZ];
+
+  int fd = openfile(O_RDWR);
+  if(read(fd, buf, 10) != 10)
+    fail("read");
+  if(pread(fd, buf, BUFSZ, 5 * BUFSZ) != BUFSZ || memcmp(buf, data + 5 * BUFSZ, BUFSZ) != 0)
+    fail("pread");
+  if(pread(fd, buf, BUFSZ, sizeof(data) - 100) != 100)
+    fail("pread past end of file");
+  if(read(fd, buf, 10) != 10 || memcmp(buf, data + 10, 10) != 0)
+    fail("offset after pread");
+
+  memset(buf, 'x', BUFSZ);
+  if(pwrite(fd, buf, BUFSZ, 2 * BUFSZ + 7) != BUFSZ)
+    fail("pwrite");
+  if(write(fd, "y", 1) != 1)
+    fail("write");
+  close(fd);
+
+  fd = openfile(O_RDONLY);
+  if(read(fd, back, sizeof(back)) != sizeof(back))
+    fail("read");
+  close(fd);
+  memmove(data + 2 * BUFSZ + 7, buf, BUFSZ);
+  data[20] = 'y';
+  if(memcmp(data, back, sizeof(data)) != 0)
+    fail("pwrite data");
+  if(pread(fd, buf, 1, 0) != -1)
+    fail("pread of a closed fd");
+
+  int p[2];
+  if(pipe(p) < 0)
+    fail("pipe");
+  if(pwrite(p[1], buf, 1, 0) != -1 || pread(p[0], buf, 1, 0) != -1)
+    fail("pread of a pipe");
+  close(p[0]);
+  close(p[1]);
+}
+
+void
+writebench(void)
+{
+  char hdr[HDRSZ];
+  struct iovec iov[2];
+
+  memset(hdr, 'h', HDRSZ);
+  int fd = openfile(O_CREATE|O_TRUNC|O_WRONLY);
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < NREC; i++){
+    if(write(fd, hdr, HDRSZ) != HDRSZ || write(fd, data, BODYSZ) != BODYSZ)
+      fail("write");
+  }
+  uint64 t1 = clock_ns();
+  close(fd);
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = HDRSZ;
+  iov[1].iov_base = data;
+  iov[1].iov_len = BODYSZ;
+  fd = openfile(O_CREATE|O_TRUNC|O_WRONLY);
+  uint64 t2 = clock_ns();
+  for(int i = 0; i < NREC; i++){
+    if(writev(fd, iov, 2) != HDRSZ + BODYSZ)
+      fail("writev");
+  }
+  uint64 t3 = clock_ns();
+  close(fd);
+
+  printf("write %d records of %d+%d bytes: %d us with write(), %d us with writev()\n",
+         NREC, HDRSZ, BODYSZ, (int)((t1 - t0) / 1000), (int)((t3 - t2) / 1000));
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int i = 0; i < sizeof(data); i++)
+    data[i] = 'a' + (i * 7 + i / BUFSZ) % 26;
+
+  vectest();
+  postest();
+  printf("iovtest: OK\n");
+  writebench();
+  unlink(file);
+  exit(0);
+}
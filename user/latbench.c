@@ -0,0 +1,99 @@
+//
+// interactive latency benchmark: pipe ping-pong between two
+// processes that sleep for each other most of the time,
+// first alone, then alongside CPU-bound hogs, and then with
+// the hogs niced. Under round robin each wakeup waits for
+// the hogs queued ahead of it; under MLFQ (make
+// SCHEDPOLICY=MLFQ) the hogs sink below the ping-pong pair.
+// Reports the mean round trip in microseconds.
+//
+// usage: latbench [nhog]
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define ROUNDS 100
+#define MAXHOG 16
+
+// the mean round trip, in microseconds.
+int
+pingpong(void)
+{
+  int a[2], b[2];
+  char c = 0;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf("latbench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("latbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(a[1]);
+    close(b[0]);
+    while(read(a[0], &c, 1) == 1)
+      write(b[1], &c, 1);
+    exit(0);
+  }
+  close(a[0]);
+  close(b[1]);
+
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < ROUNDS; i++){
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1){
+      printf("latbench: ping-pong failed\n");
+      exit(1);
+    }
+  }
+  uint64 t1 = clock_ns();
+
+  close(a[1]);
+  close(b[0]);
+  wait(0);
+  return (t1 - t0) / ROUNDS / 1000;
+}
+
+// run the ping-pong next to n hogs at nice level inc.
+void
+hogbench(int n, int inc)
+{
+  int hogs[MAXHOG];
+
+  for(int i = 0; i < n; i++){
+    if((hogs[i] = fork()) < 0){
+      printf("latbench: fork failed\n");
+      exit(1);
+    }
+    if(hogs[i] == 0){
+      nice(inc);
+      for(;;)
+        ;
+    }
+  }
+  // let the hogs use up their first time slices.
+  sleep(10);
+
+  int t = pingpong();
+  for(int i = 0; i < n; i++){
+    kill(hogs[i]);
+    wait(0);
+  }
+  printf("%d round trips, %d hogs at nice %d: %d us each\n", ROUNDS, n, inc, t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nhog = argc > 1 ? atoi(argv[1]) : 8;
+  if(nhog < 1 || nhog > MAXHOG)
+    nhog = 8;
+
+  printf("%d round trips, no hogs: %d us each\n", ROUNDS, pingpong());
+  hogbench(nhog, 0);
+  hogbench(nhog, 2);
+  exit(0);
+}
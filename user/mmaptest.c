@@ -0,0 +1,287 @@
+//
+// tests for mmap() and munmap().
+//
+
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+char *testname = "???";
+
+void
+err(char *why)
+{
+  printf("mmaptest: %s failed: %s, pid=%d\n", testname, why, getpid());
+  exit(1);
+}
+
+// make a file of 1.5 pages: 'A' in the first page,
+// 'B' in the rest.
+void
+makefile(const char *f)
+{
+  char buf[BSIZE];
+  int i, n = PGSIZE + PGSIZE/2;
+
+  unlink(f);
+  int fd = open(f, O_WRONLY | O_CREATE);
+  if(fd < 0)
+    err("open");
+  for(i = 0; i < n; i += BSIZE){
+    memset(buf, i < PGSIZE ? 'A' : 'B', BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+  }
+  if(close(fd) < 0)
+    err("close");
+}
+
+// check that [p, p+n) holds the contents of makefile(),
+// followed by zeros up to the end of the page.
+void
+checkfile(char *p, int n)
+{
+  for(int i = 0; i < PGROUNDUP(n); i++){
+    char want = i >= n ? 0 : (i < PGSIZE ? 'A' : 'B');
+    if(p[i] != want)
+      err("wrong contents");
+  }
+}
+
+void
+privatetest(void)
+{
+  const char *f = "mmap.dur";
+  int n = PGSIZE + PGSIZE/2;
+
+  testname = "private";
+  makefile(f);
+  int fd = open(f, O_RDONLY);
+  if(fd < 0)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1)
+    err("mmap");
+  close(fd);
+  checkfile(p, n);
+
+  // writes are private to this process.
+  p[0] = 'Z';
+  if(munmap(p, PGSIZE*2) < 0)
+    err("munmap");
+  fd = open(f, O_RDONLY);
+  char c;
+  if(read(fd, &c, 1) != 1 || c != 'A')
+    err("private write reached the file");
+  close(fd);
+
+  // a read-only file can't be mapped shared and writable.
+  fd = open(f, O_RDONLY);
+  if(mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1)
+    err("mmap of read-only file succeeded");
+  close(fd);
+  printf("%s: OK\n", testname);
+}
+
+void
+sharedtest(void)
+{
+  const char *f = "mmap.dur";
+  int n = PGSIZE + PGSIZE/2;
+
+  testname = "shared";
+  makefile(f);
+  int fd = open(f, O_RDWR);
+  if(fd < 0)
+    err("open");
+  char *p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1)
+    err("mmap");
+  checkfile(p, n);
+  for(int i = 0; i < n; i++)
+    p[i] = 'Z';
+
+  // unmap the first page; it is written back.
+  if(munmap(p, PGSIZE) < 0)
+    err("munmap 1");
+  char buf[2];
+  if(read(fd, buf, 1) != 1 || buf[0] != 'Z')
+    err("first page not written back");
+
+  // a child shares the mapping, and writes it back
+  // when it exits.
+  int pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  if(munmap(p + PGSIZE, PGSIZE) < 0)
+    err("munmap 2");
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  for(int i = 0; i < n; i++){
+    if(read(fd, buf, 1) != 1 || buf[0] != 'Z')
+      err("second page not written back");
+  }
+  // writing back must not have grown the file.
+  if(read(fd, buf, 1) != 0)
+    err("file grew");
+  close(fd);
+  unlink(f);
+  printf("%s: OK\n", testname);
+}
+
+void
+anontest(void)
+{
+  testname = "anonymous";
+  int n = 10*PGSIZE;
+
+  // private anonymous memory is copied by fork.
+  char *p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1)
+    err("mmap private");
+  for(int i = 0; i < n; i += PGSIZE)
+    if(p[i] != 0)
+      err("not zero");
+  p[0] = 1;
+
+  // shared anonymous memory is shared with children.
+  int *shared = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == (int*)-1)
+    err("mmap shared");
+
+  int pid = fork();
+  if(pid < 0)
+    err("fork");
+  if(pid == 0){
+    if(p[0] != 1)
+      err("child lost private data");
+    p[0] = 2;
+    *shared = 42;
+    exit(0);
+  }
+  wait(0);
+  if(p[0] != 1)
+    err("child's private write seen by parent");
+  if(*shared != 42)
+    err("child's shared write not seen by parent");
+
+  // punch a hole in the middle.
+  if(munmap(p + 2*PGSIZE, 2*PGSIZE) < 0)
+    err("munmap hole");
+  p[PGSIZE] = 3;
+  p[4*PGSIZE] = 4;
+  if(p[PGSIZE] != 3 || p[4*PGSIZE] != 4)
+    err("around the hole");
+  pid = fork();
+  if(pid == 0){
+    p[2*PGSIZE] = 1;   // should fault
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != -1)
+    err("touching the hole did not fault");
+
+  if(munmap(p, n) < 0 || munmap(shared, PGSIZE) < 0)
+    err("munmap");
+  printf("%s: OK\n", testname);
+}
+
+// write() to a file mapped MAP_SHARED shows in the
+// mapping, and in mappings made after it.
+void
+writetest(void)
+{
+  const char *f = "mmap.dur";
+  int n = PGSIZE + PGSIZE/2;
+
+  testname = "write";
+  makefile(f);
+  int fd = open(f, O_RDWR);
+  if(fd < 0)
+    err("open");
+  char *p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1)
+    err("mmap");
+  checkfile(p, n);
+  p[0] = 'Z';
+  if(write(fd, "xyz", 3) != 3)
+    err("write");
+  if(p[0] != 'x' || p[1] != 'y' || p[2] != 'z' || p[3] != 'A')
+    err("write not seen by mapping");
+  char *q = mmap(0, n, PROT_READ, MAP_SHARED, fd, 0);
+  if(q == (char*)-1)
+    err("mmap 2");
+  if(q[0] != 'x' || q[PGSIZE] != 'B')
+    err("write not seen by second mapping");
+  if(munmap(q, n) < 0 || munmap(p, n) < 0)
+    err("munmap");
+  close(fd);
+  unlink(f);
+  printf("%s: OK\n", testname);
+}
+
+// a munmap() that would split a region when there is no
+// free slot for the second half fails and changes nothing.
+void
+splittest(void)
+{
+  char *r[64];
+  int n;
+
+  testname = "split";
+  for(n = 0; n < 64; n++){
+    r[n] = mmap(0, 3*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(r[n] == (char*)-1)
+      break;
+    r[n][0] = r[n][PGSIZE] = r[n][2*PGSIZE] = n;
+  }
+  if(n == 0 || n == 64)
+    err("filling the region slots");
+  if(munmap(r[0] + PGSIZE, PGSIZE) == 0)
+    err("munmap of the middle succeeded");
+  if(r[0][0] != 0 || r[0][PGSIZE] != 0 || r[0][2*PGSIZE] != 0)
+    err("failed munmap changed the region");
+  for(int i = 0; i < n; i++)
+    if(munmap(r[i], 3*PGSIZE) < 0)
+      err("munmap");
+  printf("%s: OK\n", testname);
+}
+
+// mapping and unmapping many times must not leak memory.
+void
+leaktest(void)
+{
+  testname = "leak";
+  for(int i = 0; i < 100; i++){
+    char *p = mmap(0, 64*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == (char*)-1)
+      err("mmap");
+    for(int j = 0; j < 64; j++)
+      p[j*PGSIZE] = j;
+    if(munmap(p, 64*PGSIZE) < 0)
+      err("munmap");
+  }
+  printf("%s: OK\n", testname);
+}
+
+int
+main(int argc, char *argv[])
+{
+  privatetest();
+  sharedtest();
+  writetest();
+  splittest();
+  anontest();
+  leaktest();
+  printf("mmaptest: all tests succeeded\n");
+  exit(0);
+}
@@ -0,0 +1,100 @@
+//
+// tests and benchmarks for clock_ns() and sleep_ns(): the
+// clock's resolution, how long sleep_ns() oversleeps for
+// a range of durations, and many processes sleeping for
+// different times at once, none of which may wake early.
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NSLEEP 20
+#define NCHILD 8
+
+void
+clocktest(void)
+{
+  uint64 t, last = clock_ns(), res = -1;
+
+  for(int i = 0; i < 10000; i++){
+    t = clock_ns();
+    if(t < last){
+      printf("nsbench: clock_ns went backwards\n");
+      exit(1);
+    }
+    if(t > last && t - last < res)
+      res = t - last;
+    last = t;
+  }
+  printf("clock: resolution %d ns\n", (int)res);
+}
+
+// sleep NSLEEP times for ns each, and report the mean and
+// worst oversleep.
+void
+sleepbench(uint64 ns)
+{
+  uint64 total = 0, worst = 0;
+
+  for(int i = 0; i < NSLEEP; i++){
+    uint64 t0 = clock_ns();
+    if(sleep_ns(ns) < 0){
+      printf("nsbench: sleep_ns failed\n");
+      exit(1);
+    }
+    uint64 t = clock_ns() - t0;
+    if(t < ns){
+      printf("nsbench: slept %d ns, not %d\n", (int)t, (int)ns);
+      exit(1);
+    }
+    total += t - ns;
+    if(t - ns > worst)
+      worst = t - ns;
+  }
+  printf("sleep %d us: late by %d us on average, %d us at worst\n",
+         (int)(ns / 1000), (int)(total / NSLEEP / 1000), (int)(worst / 1000));
+}
+
+// children sleep for different times at once, so that
+// each hart's timer heap holds several deadlines.
+void
+manytest(void)
+{
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("nsbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 50; j++){
+        uint64 ns = ((i + j) % NCHILD + 1) * 100000;
+        uint64 t0 = clock_ns();
+        if(sleep_ns(ns) < 0 || clock_ns() - t0 < ns)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(int i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("nsbench: manytest: woke early\n");
+      exit(1);
+    }
+  }
+  printf("manytest: OK\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  clocktest();
+  sleepbench(10000);
+  sleepbench(100000);
+  sleepbench(1000000);
+  sleepbench(10000000);
+  manytest();
+  exit(0);
+}
@@ -0,0 +1,112 @@
+//
+// tests for sched_setaffinity(), and a benchmark of pipe
+// ping-pong between a producer and a consumer left to the
+// scheduler, pinned to the same hart, and pinned to two
+// different harts, with the migrations each pair made.
+//
+
+#include "kernel/types.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+#define ROUNDS 5000
+
+// a pinned process runs on its hart, and only there.
+void
+pintest(uint all)
+{
+  struct schedinfo si;
+
+  for(int h = 0; h < 32; h++){
+    if((all & (1 << h)) == 0)
+      continue;
+    if(sched_setaffinity(0, 1 << h) < 0 || sched_getaffinity(0) != (1 << h)){
+      printf("pinbench: pintest: setaffinity %d failed\n", h);
+      exit(1);
+    }
+    for(int i = 0; i < 10; i++){
+      sleep(1);
+      if(schedinfo(0, &si) < 0 || si.cpu != h){
+        printf("pinbench: pintest: ran on hart %d, not %d\n", si.cpu, h);
+        exit(1);
+      }
+    }
+  }
+  if(sched_setaffinity(0, 0) != -1 || sched_setaffinity(0, all) < 0){
+    printf("pinbench: pintest: bad mask accepted\n");
+    exit(1);
+  }
+  printf("pintest: OK\n");
+}
+
+// run ROUNDS round trips between two processes, the first
+// pinned to harts a and the second to harts b.
+void
+pingpong(char *what, uint a, uint b)
+{
+  int p1[2], p2[2];
+  struct schedinfo si;
+  char c = 0;
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("pinbench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("pinbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    sched_setaffinity(0, b);
+    for(int i = 0; i < ROUNDS; i++){
+      if(read(p1[0], &c, 1) != 1 || write(p2[1], &c, 1) != 1)
+        exit(1);
+    }
+    schedinfo(0, &si);
+    exit(si.nmigrate);
+  }
+  sched_setaffinity(0, a);
+  schedinfo(0, &si);
+  int m0 = si.nmigrate;
+
+  int t0 = uptime();
+  for(int i = 0; i < ROUNDS; i++){
+    if(write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1){
+      printf("pinbench: ping-pong failed\n");
+      exit(1);
+    }
+  }
+  int t1 = uptime();
+  schedinfo(0, &si);
+
+  int xstatus;
+  wait(&xstatus);
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[0]);
+  close(p2[1]);
+  printf("%s: %d round trips: %d ticks, %d migrations\n",
+         what, ROUNDS, t1 - t0, si.nmigrate - m0 + xstatus);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint all = sched_getaffinity(0);
+  int h0, h1;
+
+  pintest(all);
+
+  for(h0 = 0; (all & (1 << h0)) == 0; h0++)
+    ;
+  for(h1 = h0 + 1; h1 < 32 && (all & (1 << h1)) == 0; h1++)
+    ;
+
+  pingpong("unpinned", all, all);
+  pingpong("same hart", 1 << h0, 1 << h0);
+  if(h1 < 32)
+    pingpong("two harts", 1 << h0, 1 << h1);
+  sched_setaffinity(0, all);
+  exit(0);
+}
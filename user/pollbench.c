@@ -0,0 +1,181 @@
+//
+// tests for poll(), and a fan-in benchmark: NPROD producers
+// each write NMSG messages down their own pipe to one
+// consumer, which either waits on all the pipes with poll(),
+// or, as without poll(), has a relay process per pipe copy
+// into one shared pipe that it reads.
+//
+
+#include "kernel/types.h"
+#include "kernel/poll.h"
+#include "user/user.h"
+
+#define NPROD 32
+#define NMSG  200
+#define MSGSZ 16
+
+void
+fail(char *what)
+{
+  printf("pollbench: %s failed\n", what);
+  exit(1);
+}
+
+void
+polltest(void)
+{
+  struct pollfd fds[2];
+  int p[2];
+  char c;
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  fds[0].fd = p[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = p[1];
+  fds[1].events = POLLOUT;
+  if(poll(fds, 2, 0) != 1 || fds[0].revents != 0 || fds[1].revents != POLLOUT)
+    fail("poll of an empty pipe");
+
+  uint64 t0 = clock_ns();
+  if(poll(fds, 1, 20) != 0)
+    fail("poll timeout");
+  if(clock_ns() - t0 < 20 * 1000000ULL)
+    fail("poll timeout length");
+
+  int pid = fork();
+  if(pid < 0)
+    fail("fork");
+  if(pid == 0){
+    sleep(2);
+    write(p[1], "x", 1);
+    exit(0);
+  }
+  if(poll(fds, 1, -1) != 1 || fds[0].revents != POLLIN)
+    fail("poll wakeup");
+  if(read(p[0], &c, 1) != 1 || c != 'x')
+    fail("read after poll");
+  wait(0);
+
+  close(p[1]);
+  if(poll(fds, 1, -1) != 1 || (fds[0].revents & POLLHUP) == 0)
+    fail("poll of a closed pipe");
+  close(p[0]);
+  fds[1].fd = -1;
+  if(poll(fds, 2, 0) != 1 || fds[0].revents != POLLNVAL || fds[1].revents != 0)
+    fail("poll of a closed fd");
+  printf("polltest: OK\n");
+}
+
+// fork a producer writing NMSG messages into a new pipe, and
+// return the pipe's read end.
+int
+producer(void)
+{
+  char msg[MSGSZ];
+  int p[2];
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  int pid = fork();
+  if(pid < 0)
+    fail("fork");
+  if(pid == 0){
+    close(p[0]);
+    memset(msg, 'm', MSGSZ);
+    for(int i = 0; i < NMSG; i++){
+      if(write(p[1], msg, MSGSZ) != MSGSZ)
+        exit(1);
+    }
+    exit(0);
+  }
+  close(p[1]);
+  return p[0];
+}
+
+// read everything from the producers through poll().
+// Returns the time taken, in us.
+int
+pollfanin(void)
+{
+  struct pollfd fds[NPROD];
+  char buf[512];
+  int n, open = NPROD, total = 0;
+
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < NPROD; i++){
+    fds[i].fd = producer();
+    fds[i].events = POLLIN;
+  }
+  while(open > 0){
+    if(poll(fds, NPROD, -1) <= 0)
+      fail("poll");
+    for(int i = 0; i < NPROD; i++){
+      if(fds[i].revents == 0)
+        continue;
+      if((n = read(fds[i].fd, buf, sizeof(buf))) < 0)
+        fail("read");
+      if(n == 0){
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open--;
+      }
+      total += n;
+    }
+  }
+  for(int i = 0; i < NPROD; i++)
+    wait(0);
+  uint64 t1 = clock_ns();
+  if(total != NPROD * NMSG * MSGSZ)
+    fail("poll fan-in count");
+  return (t1 - t0) / 1000;
+}
+
+// read everything from the producers through a relay process
+// per producer. Returns the time taken, in us.
+int
+relayfanin(void)
+{
+  char buf[512];
+  int out[2], n, total = 0;
+
+  uint64 t0 = clock_ns();
+  if(pipe(out) < 0)
+    fail("pipe");
+  for(int i = 0; i < NPROD; i++){
+    int in = producer();
+    int pid = fork();
+    if(pid < 0)
+      fail("fork");
+    if(pid == 0){
+      close(out[0]);
+      while((n = read(in, buf, MSGSZ)) > 0){
+        if(write(out[1], buf, n) != n)
+          exit(1);
+      }
+      exit(0);
+    }
+    close(in);
+  }
+  close(out[1]);
+  while((n = read(out[0], buf, sizeof(buf))) > 0)
+    total += n;
+  close(out[0]);
+  for(int i = 0; i < 2 * NPROD; i++)
+    wait(0);
+  uint64 t1 = clock_ns();
+  if(total != NPROD * NMSG * MSGSZ)
+    fail("relay fan-in count");
+  return (t1 - t0) / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  polltest();
+  int t0 = relayfanin();
+  int t1 = pollfanin();
+  printf("%d producers x %d messages: %d us with relays, %d us with poll\n",
+         NPROD, NMSG, t0, t1);
+  exit(0);
+}
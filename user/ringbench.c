@@ -0,0 +1,215 @@
+//
+// ring_enter() benchmarks against plain system call loops:
+// small writes to a file, one-byte reads back from it as
+// gets() does, and open/read/close of a file chained in one
+// submission. Each also checks the data it got.
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/ring.h"
+#include "user/user.h"
+
+#define NREC   2000
+#define RECSZ  16
+#define NOPEN  200
+
+char *file = "ringbench.tmp";
+struct ring ring;
+char data[NREC * RECSZ];
+char back[NREC * RECSZ];
+
+// wait for a completion, and return its result.
+int
+reap(void)
+{
+  struct cqe *c = ring_cqe(&ring);
+  if(c == 0){
+    printf("ringbench: missing completion\n");
+    exit(1);
+  }
+  int res = c->res;
+  ring_cqdone(&ring);
+  return res;
+}
+
+// queue an entry, submitting the ring first if it is full.
+struct sqe*
+post(int op, int fd, void *addr, int len)
+{
+  struct sqe *s;
+
+  if((s = ring_sqe(&ring)) == 0){
+    if(ring_submit(&ring) < 0){
+      printf("ringbench: ring_enter failed\n");
+      exit(1);
+    }
+    while(ring_cqe(&ring))
+      ring_cqdone(&ring);
+    s = ring_sqe(&ring);
+  }
+  s->op = op;
+  s->fd = fd;
+  s->addr = (uint64)addr;
+  s->len = len;
+  return s;
+}
+
+int
+openfile(int mode)
+{
+  int fd = open(file, mode);
+  if(fd < 0){
+    printf("ringbench: open failed\n");
+    exit(1);
+  }
+  return fd;
+}
+
+void
+check(char *what)
+{
+  if(memcmp(data, back, sizeof(data)) != 0){
+    printf("ringbench: %s: wrong data\n", what);
+    exit(1);
+  }
+}
+
+// read the file back with one big read().
+void
+readback(void)
+{
+  int fd = openfile(O_RDONLY);
+  memset(back, 0, sizeof(back));
+  if(read(fd, back, sizeof(back)) != sizeof(back)){
+    printf("ringbench: short read\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+void
+writebench(void)
+{
+  int fd = openfile(O_CREATE|O_TRUNC|O_WRONLY);
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < NREC; i++){
+    if(write(fd, data + i*RECSZ, RECSZ) != RECSZ){
+      printf("ringbench: write failed\n");
+      exit(1);
+    }
+  }
+  uint64 t1 = clock_ns();
+  close(fd);
+  readback();
+  check("write()");
+
+  // the completions are dropped as post() makes room; the
+  // check of the file afterwards catches a short write.
+  fd = openfile(O_CREATE|O_TRUNC|O_WRONLY);
+  uint64 t2 = clock_ns();
+  for(int i = 0; i < NREC; i++)
+    post(RING_WRITE, fd, data + i*RECSZ, RECSZ);
+  ring_submit(&ring);
+  uint64 t3 = clock_ns();
+  while(ring_cqe(&ring))
+    ring_cqdone(&ring);
+  close(fd);
+  readback();
+  check("ring write");
+
+  printf("write %d records of %d bytes: %d us with write(), %d us with the ring\n",
+         NREC, RECSZ, (int)((t1 - t0) / 1000), (int)((t3 - t2) / 1000));
+}
+
+void
+readbench(void)
+{
+  int n = sizeof(back);
+
+  int fd = openfile(O_RDONLY);
+  memset(back, 0, n);
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < n; i++){
+    if(read(fd, back + i, 1) != 1){
+      printf("ringbench: read failed\n");
+      exit(1);
+    }
+  }
+  uint64 t1 = clock_ns();
+  close(fd);
+  check("read()");
+
+  fd = openfile(O_RDONLY);
+  memset(back, 0, n);
+  uint64 t2 = clock_ns();
+  for(int i = 0; i < n; i += RING_SIZE){
+    for(int j = i; j < i + RING_SIZE && j < n; j++)
+      post(RING_READ, fd, back + j, 1);
+    ring_submit(&ring);
+    for(int j = i; j < i + RING_SIZE && j < n; j++){
+      if(reap() != 1){
+        printf("ringbench: ring read failed\n");
+        exit(1);
+      }
+    }
+  }
+  uint64 t3 = clock_ns();
+  close(fd);
+  check("ring read");
+
+  printf("read %d bytes one at a time: %d us with read(), %d us with the ring\n",
+         n, (int)((t1 - t0) / 1000), (int)((t3 - t2) / 1000));
+}
+
+// open, read a record and close, NOPEN times.
+void
+openbench(void)
+{
+  char rec[RECSZ];
+
+  uint64 t0 = clock_ns();
+  for(int i = 0; i < NOPEN; i++){
+    int fd = openfile(O_RDONLY);
+    if(read(fd, rec, RECSZ) != RECSZ){
+      printf("ringbench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  uint64 t1 = clock_ns();
+
+  for(int i = 0; i < NOPEN; i++){
+    memset(rec, 0, RECSZ);
+    post(RING_OPEN, 0, file, O_RDONLY);
+    post(RING_READ, 0, rec, RECSZ)->flags = RING_OPENFD;
+    post(RING_CLOSE, 0, 0, 0)->flags = RING_OPENFD;
+    if(ring_submit(&ring) != 3){
+      printf("ringbench: ring_enter failed\n");
+      exit(1);
+    }
+    int fd = reap();
+    int n = reap();
+    if(fd < 0 || n != RECSZ || reap() != 0 || memcmp(rec, data, RECSZ) != 0){
+      printf("ringbench: ring open/read/close failed\n");
+      exit(1);
+    }
+  }
+  uint64 t2 = clock_ns();
+
+  printf("open/read/close %d times: %d us with system calls, %d us with the ring\n",
+         NOPEN, (int)((t1 - t0) / 1000), (int)((t2 - t1) / 1000));
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int i = 0; i < sizeof(data); i++)
+    data[i] = 'a' + (i * 7 + i / RECSZ) % 26;
+
+  writebench();
+  readbench();
+  openbench();
+  unlink(file);
+  exit(0);
+}
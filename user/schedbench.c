@@ -0,0 +1,142 @@
+//
+// scheduling benchmarks: fork/exit/wait throughput in the
+// style of forktest, pipe ping-pong between pairs of
+// processes, and ping-pong latency while CPU-bound
+// processes keep every hart busy, as in grind.
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NFORK   500
+#define BATCH   20
+#define ROUNDS  1000
+
+char stats[4096];
+
+// print the run queue section of the statistics device.
+void
+rqstats(void)
+{
+  char *tag = "--- run queues";
+  int n = statistics(stats, sizeof(stats)-1);
+  if(n < 0)
+    return;
+  stats[n] = 0;
+  for(char *p = stats; *p; p++){
+    if(memcmp(p, tag, strlen(tag)) == 0){
+      char *e = strchr(p + 1, '-');
+      if(e)
+        *e = 0;
+      printf("%s", p);
+      return;
+    }
+  }
+}
+
+void
+forkbench(void)
+{
+  int t0 = uptime();
+  for(int n = 0; n < NFORK; n += BATCH){
+    for(int i = 0; i < BATCH; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("schedbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        exit(0);
+    }
+    for(int i = 0; i < BATCH; i++)
+      wait(0);
+  }
+  printf("fork: %d forks: %d ticks\n", NFORK, uptime() - t0);
+}
+
+// a child bounces a byte back and forth with its own
+// child ROUNDS times.
+void
+pingpong(void)
+{
+  int a[2], b[2];
+  char c = 0;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("schedbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < ROUNDS; i++){
+      if(read(a[0], &c, 1) != 1 || write(b[1], &c, 1) != 1)
+        exit(1);
+    }
+    exit(0);
+  }
+  for(int i = 0; i < ROUNDS; i++){
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1)
+      exit(1);
+  }
+  wait(0);
+  exit(0);
+}
+
+// run npairs ping-pong pairs at once, alongside nspin
+// CPU-bound processes.
+void
+pairbench(int npairs, int nspin)
+{
+  int spinners[16];
+
+  for(int i = 0; i < nspin; i++){
+    if((spinners[i] = fork()) == 0){
+      for(;;)
+        ;
+    }
+  }
+
+  int t0 = uptime();
+  for(int i = 0; i < npairs; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("schedbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      pingpong();
+  }
+  for(int i = 0; i < npairs; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("schedbench: ping-pong failed\n");
+      exit(1);
+    }
+  }
+  int t1 = uptime();
+
+  for(int i = 0; i < nspin; i++){
+    kill(spinners[i]);
+    wait(0);
+  }
+  printf("pingpong: %d pairs, %d spinners, %d rounds: %d ticks\n",
+         npairs, nspin, ROUNDS, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  forkbench();
+  pairbench(1, 0);
+  pairbench(2, 0);
+  pairbench(4, 0);
+  pairbench(1, 4);
+  pairbench(4, 8);
+  rqstats();
+  exit(0);
+}
@@ -0,0 +1,143 @@
+//
+// splice() against the read()/write() loop of cat: send a
+// file of many blocks down a pipe to a reader that checks
+// it, each way, and then the reverse, from a pipe into a
+// file.
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILESZ (64 * 1024)
+
+char *file = "splicebench.tmp";
+char data[FILESZ];
+char buf[512];
+
+void
+fail(char *what)
+{
+  printf("splicebench: %s failed\n", what);
+  unlink(file);
+  exit(1);
+}
+
+// fork a reader of the pipe p that checks what it reads
+// against data.
+int
+reader(int p[2])
+{
+  int pid = fork();
+  if(pid < 0)
+    fail("fork");
+  if(pid == 0){
+    int n, tot = 0;
+    close(p[1]);
+    while((n = read(p[0], buf, sizeof(buf))) > 0){
+      if(tot + n > FILESZ || memcmp(buf, data + tot, n) != 0)
+        exit(1);
+      tot += n;
+    }
+    exit(tot == FILESZ ? 0 : 1);
+  }
+  close(p[0]);
+  return pid;
+}
+
+// send the file down a pipe, with splice() if usesplice,
+// else as cat does. Returns the time taken, in us.
+int
+topipe(int usesplice)
+{
+  int p[2], n, xstatus;
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  reader(p);
+  int fd = open(file, O_RDONLY);
+  if(fd < 0)
+    fail("open");
+  uint64 t0 = clock_ns();
+  if(usesplice){
+    if(splice(fd, p[1], FILESZ) != FILESZ || splice(fd, p[1], 1) != 0)
+      fail("splice");
+  } else {
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+      if(write(p[1], buf, n) != n)
+        fail("write");
+    }
+  }
+  close(p[1]);
+  wait(&xstatus);
+  uint64 t1 = clock_ns();
+  close(fd);
+  if(xstatus != 0)
+    fail(usesplice ? "splice data" : "read/write data");
+  return (t1 - t0) / 1000;
+}
+
+// copy the file into a pipe with a writer child, and from
+// the pipe into a new file with splice().
+void
+frompipe(void)
+{
+  int p[2], xstatus;
+  char back[512];
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  int pid = fork();
+  if(pid < 0)
+    fail("fork");
+  if(pid == 0){
+    close(p[0]);
+    exit(write(p[1], data, FILESZ) == FILESZ ? 0 : 1);
+  }
+  close(p[1]);
+  int fd = open(file, O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd < 0)
+    fail("open");
+  if(splice(p[0], fd, FILESZ + 1) != FILESZ)
+    fail("splice from pipe");
+  close(fd);
+  close(p[0]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    fail("write to pipe");
+
+  fd = open(file, O_RDONLY);
+  for(int off = 0; off < FILESZ; off += sizeof(back)){
+    if(read(fd, back, sizeof(back)) != sizeof(back) ||
+       memcmp(back, data + off, sizeof(back)) != 0)
+      fail("splice from pipe data");
+  }
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int i = 0; i < FILESZ; i++)
+    data[i] = 'a' + (i * 7 + i / 512) % 26;
+  int fd = open(file, O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd < 0 || write(fd, data, FILESZ) != FILESZ)
+    fail("create");
+  close(fd);
+
+  fd = open(file, O_RDONLY);
+  int fd1 = open(file, O_RDWR);
+  if(splice(fd, fd1, 1) != -1)
+    fail("splice without a pipe");
+  close(fd);
+  close(fd1);
+
+  int t0 = topipe(0);
+  int t1 = topipe(1);
+  printf("%d KB file to a pipe: %d us with read/write, %d us with splice\n",
+         FILESZ / 1024, t0, t1);
+  frompipe();
+  printf("splicebench: OK\n");
+  unlink(file);
+  exit(0);
+}
@@ -0,0 +1,291 @@
+//
+// tests for clone() and join(), through thread_create() and
+// thread_join(), and a benchmark that sums a large array
+// with one thread and then with several sharing it.
+//
+// usage: threadtest [nthread]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NELEM (4*1024*1024)
+#define MAXT  8
+
+int *array;
+uint64 sums[MAXT];
+int nthread;
+volatile int go;
+
+struct part {
+  int id;
+  int lo, hi;
+};
+
+void
+sum(void *a)
+{
+  struct part *p = a;
+  uint64 s = 0;
+
+  while(go == 0)
+    ;
+  for(int i = p->lo; i < p->hi; i++)
+    s += array[i];
+  sums[p->id] = s;
+}
+
+// sum the array with n threads, and return the ticks taken.
+int
+sumbench(int n, uint64 *total)
+{
+  struct part parts[MAXT];
+  int tids[MAXT];
+
+  go = 0;
+  for(int i = 0; i < n; i++){
+    parts[i].id = i;
+    parts[i].lo = (NELEM / n) * i;
+    parts[i].hi = i == n-1 ? NELEM : (NELEM / n) * (i+1);
+    if((tids[i] = thread_create(sum, &parts[i])) < 0){
+      printf("threadtest: thread_create failed\n");
+      exit(1);
+    }
+  }
+  int t0 = uptime();
+  go = 1;
+  *total = 0;
+  for(int i = 0; i < n; i++){
+    if(thread_join(tids[i], 0) < 0){
+      printf("threadtest: thread_join failed\n");
+      exit(1);
+    }
+    *total += sums[i];
+  }
+  return uptime() - t0;
+}
+
+// threads see each other's stores, and memory that
+// another thread allocated.
+char *shared;
+
+void
+grow(void *a)
+{
+  shared = sbrk(PGSIZE);
+  if(shared == (char*)-1)
+    exit(1);
+  shared[0] = 'x';
+}
+
+void
+sharetest(void)
+{
+  int tid = thread_create(grow, 0);
+  if(tid < 0 || thread_join(tid, 0) < 0){
+    printf("threadtest: sharetest: thread failed\n");
+    exit(1);
+  }
+  if(shared == (char*)-1 || shared[0] != 'x'){
+    printf("threadtest: sharetest: sbrk in thread not seen\n");
+    exit(1);
+  }
+  if(thread_join(tid, 0) != -1 || wait(0) != -1){
+    printf("threadtest: sharetest: thread reaped twice\n");
+    exit(1);
+  }
+  printf("sharetest: OK\n");
+}
+
+// threads map and unmap memory while others run, so that
+// every unmap must reach the others' TLBs.
+void
+mapper(void *a)
+{
+  int id = (uint64)a;
+
+  for(int i = 0; i < 200; i++){
+    char *p = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p == (char*)-1)
+      exit(1);
+    for(int j = 0; j < 4; j++)
+      p[j*PGSIZE] = id;
+    for(int j = 0; j < 4; j++)
+      if(p[j*PGSIZE] != id)
+        exit(1);
+    if(munmap(p, 4*PGSIZE) < 0)
+      exit(1);
+  }
+}
+
+void
+maptest(void)
+{
+  int tids[MAXT];
+
+  for(int i = 0; i < nthread; i++){
+    if((tids[i] = thread_create(mapper, (void*)(uint64)(i+1))) < 0){
+      printf("threadtest: maptest: thread_create failed\n");
+      exit(1);
+    }
+  }
+  for(int i = 0; i < nthread; i++){
+    int xstatus;
+    if(thread_join(tids[i], &xstatus) < 0 || xstatus != 0){
+      printf("threadtest: maptest: thread failed\n");
+      exit(1);
+    }
+  }
+  printf("maptest: OK\n");
+}
+
+// fork() in a thread copies the whole address space,
+// and the child is a process of its own.
+void
+forker(void *a)
+{
+  int pid = fork();
+  if(pid < 0)
+    exit(1);
+  if(pid == 0){
+    if(array[NELEM-1] != NELEM-1)
+      exit(1);
+    exit(0);
+  }
+  int xstatus;
+  if(wait(&xstatus) != pid || xstatus != 0)
+    exit(1);
+}
+
+void
+forktest(void)
+{
+  int tid, xstatus;
+
+  if((tid = thread_create(forker, 0)) < 0){
+    printf("threadtest: forktest: thread_create failed\n");
+    exit(1);
+  }
+  if(thread_join(tid, &xstatus) < 0 || xstatus != 0){
+    printf("threadtest: forktest: failed\n");
+    exit(1);
+  }
+  printf("forktest: OK\n");
+}
+
+// a fork() while a thread waits on a mutex makes the
+// mutex's page copy-on-write, and the unlock then moves the
+// mutex to a copy of the page; the waiter must still wake.
+struct mutex mu;
+
+void
+locker(void *a)
+{
+  mutex_lock(&mu);
+  mutex_unlock(&mu);
+}
+
+void
+forkwaittest(void)
+{
+  int tid, pid;
+
+  mutex_lock(&mu);
+  if((tid = thread_create(locker, 0)) < 0){
+    printf("threadtest: forkwaittest: thread_create failed\n");
+    exit(1);
+  }
+  sleep(2);  // let it wait on mu
+  if((pid = fork()) < 0){
+    printf("threadtest: forkwaittest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  mutex_unlock(&mu);
+  if(thread_join(tid, 0) < 0){
+    printf("threadtest: forkwaittest: thread_join failed\n");
+    exit(1);
+  }
+  printf("forkwaittest: OK\n");
+}
+
+// when a process's first thread exits, the others go too:
+// once they have, the pipe they hold has no writers left.
+void
+spin(void *a)
+{
+  for(;;)
+    ;
+}
+
+void
+exittest(void)
+{
+  int fds[2];
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("threadtest: exittest: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("threadtest: exittest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(int i = 0; i < 4; i++)
+      if(thread_create(spin, 0) < 0)
+        exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 0){
+    printf("threadtest: exittest: read failed\n");
+    exit(1);
+  }
+  close(fds[0]);
+  wait(0);
+  printf("exittest: OK\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 total, want = 0;
+
+  nthread = argc > 1 ? atoi(argv[1]) : 4;
+  if(nthread < 1 || nthread > MAXT)
+    nthread = 4;
+
+  array = malloc(NELEM * sizeof(int));
+  if(array == 0){
+    printf("threadtest: malloc failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < NELEM; i++){
+    array[i] = i;
+    want += i;
+  }
+
+  sharetest();
+  maptest();
+  forktest();
+  forkwaittest();
+  exittest();
+
+  for(int n = 1; n <= nthread; n *= 2){
+    int t = sumbench(n, &total);
+    if(total != want){
+      printf("threadtest: wrong sum with %d threads\n", n);
+      exit(1);
+    }
+    printf("sum of %d ints, %d threads: %d ticks\n", NELEM, n, t);
+  }
+  exit(0);
+}
@@ -0,0 +1,100 @@
+//
+// TLB-heavy benchmark: sweep a large heap one word per page,
+// first in this process, whose heap can be mapped with
+// 2-megabyte megapages, then in a forked child, whose
+// copy-on-write heap is mapped with 4096-byte pages.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define HEAP   (16*1024*1024)
+#define ROUNDS 200
+
+char stats[4096];
+
+// print the page table section of the statistics device,
+// which comes last and describes the reading process.
+void
+ptstats(void)
+{
+  char *tag = "--- page tables";
+  int n = statistics(stats, sizeof(stats)-1);
+  if(n < 0)
+    return;
+  stats[n] = 0;
+  for(char *p = stats; *p; p++){
+    if(memcmp(p, tag, strlen(tag)) == 0){
+      printf("%s", p);
+      return;
+    }
+  }
+}
+
+int
+sweep(char *heap)
+{
+  int sum = 0;
+
+  for(int r = 0; r < ROUNDS; r++)
+    for(char *q = heap; q < heap + HEAP; q += PGSIZE)
+      sum += *q;
+  return sum;
+}
+
+void
+run(char *who, char *heap)
+{
+  int t0 = uptime();
+  int sum = sweep(heap);
+  int t1 = uptime();
+  printf("%s: %d rounds over %d pages: %d ticks (%d)\n",
+         who, ROUNDS, HEAP/PGSIZE, t1 - t0, sum);
+  ptstats();
+}
+
+int
+main(int argc, char *argv[])
+{
+  // start the heap on a megapage boundary.
+  char *top = sbrk(0);
+  uint64 pad = MEGAPGSIZE - ((uint64)top % MEGAPGSIZE);
+  if(sbrk(pad) == (char*)-1){
+    printf("tlbbench: sbrk failed\n");
+    exit(1);
+  }
+  char *heap = sbrk(HEAP);
+  if(heap == (char*)-1){
+    printf("tlbbench: sbrk failed\n");
+    exit(1);
+  }
+  for(char *q = heap; q < heap + HEAP; q += PGSIZE)
+    *q = 1;
+
+  run("megapages", heap);
+
+  // a heap touched once per 2-megabyte block stays on
+  // pages; only densely used blocks become megapages.
+  char *sparse = sbrk(HEAP);
+  if(sparse == (char*)-1){
+    printf("tlbbench: sbrk failed\n");
+    exit(1);
+  }
+  for(char *q = sparse; q < sparse + HEAP; q += MEGAPGSIZE)
+    *q = 1;
+  printf("sparse: touched %d pages of another %d\n", HEAP/MEGAPGSIZE, HEAP/PGSIZE);
+  ptstats();
+
+  int pid = fork();
+  if(pid < 0){
+    printf("tlbbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    run("pages", heap);
+    exit(0);
+  }
+  wait(0);
+  exit(0);
+}
@@ -1,6 +1,10 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/ring.h"
 #include "user/user.h"
 
 char*
@@ -134,3 +138,212 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// Threads. Each one runs on a stack from malloc(), with a
+// struct thread at its top, and thread_join() frees it.
+#define TSTACK 8192
+
+struct thread {
+  void (*fn)(void*);
+  void *arg;
+  char *stack;
+  int tid;
+  struct thread *next;
+};
+
+static struct thread *threads;
+static struct mutex threadlock;
+
+static void
+thread_start(void *a)
+{
+  struct thread *t = a;
+
+  t->fn(t->arg);
+  exit(0);
+}
+
+// Start fn(arg) in a new thread of this process.
+// Returns its thread id, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  struct thread *t;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  // the stack grows down from just below t, which
+  // keeps sp 16-byte aligned.
+  t = (struct thread*)(((uint64)(stack + TSTACK) - sizeof(*t)) & ~15);
+  t->fn = fn;
+  t->arg = arg;
+  t->stack = stack;
+  if((t->tid = clone(thread_start, t, t)) < 0){
+    free(stack);
+    return -1;
+  }
+  mutex_lock(&threadlock);
+  t->next = threads;
+  threads = t;
+  mutex_unlock(&threadlock);
+  return t->tid;
+}
+
+// Wait for thread tid to finish, and free its stack. If
+// status is not 0, the thread's exit status goes there.
+// Returns 0, or -1 if there is no such thread.
+int
+thread_join(int tid, int *status)
+{
+  struct thread **tp, *t;
+
+  if(join(tid, status) != tid)
+    return -1;
+  mutex_lock(&threadlock);
+  for(tp = &threads; (t = *tp) != 0; tp = &t->next){
+    if(t->tid == tid){
+      *tp = t->next;
+      break;
+    }
+  }
+  mutex_unlock(&threadlock);
+  if(t)
+    free(t->stack);
+  return 0;
+}
+
+// Mutexes and condition variables, after Drepper's
+// "Futexes Are Tricky". Taking a free mutex and releasing
+// one that no one waits for are single atomic instructions;
+// only waiting, and waking a waiter, take system calls.
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c = __sync_val_compare_and_swap(&m->state, 0, 1);
+
+  if(c == 0)
+    return;
+  // mark it contended, so the holder wakes us.
+  if(c != 2)
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+// Returns 1 if it took m, 0 if m was held.
+int
+mutex_trylock(struct mutex *m)
+{
+  return __sync_val_compare_and_swap(&m->state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1){
+    __atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+    futex_wake(&m->state, 1);
+  }
+}
+
+// Release m, wait for cond_signal() or cond_broadcast(),
+// and take m again. Wakeups may be spurious, so check the
+// condition again after.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+  __atomic_fetch_add(&c->nwait, 1, __ATOMIC_SEQ_CST);
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  __atomic_fetch_sub(&c->nwait, 1, __ATOMIC_SEQ_CST);
+  mutex_lock(m);
+}
+
+// Wake one thread waiting on c. Call it with the mutex
+// held, so that no waiter is missed; if none waits, it
+// takes no system call.
+void
+cond_signal(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&c->nwait, __ATOMIC_SEQ_CST) > 0)
+    futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&c->nwait, __ATOMIC_SEQ_CST) > 0)
+    futex_wake(&c->seq, 0x7fffffff);
+}
+
+// system calls answered from the read-only usyscall page
+// that the kernel maps in every address space, without
+// trapping into the kernel. The clock is the time CSR,
+// which user mode may read.
+
+// the pid of the address space's first thread: in a
+// thread made by clone(), not the same as getpid().
+int
+ugetpid(void)
+{
+  return ((struct usyscall*)USYSCALL)->pid;
+}
+
+int
+uuptime(void)
+{
+  return r_time() / ((struct usyscall*)USYSCALL)->tickcycles;
+}
+
+uint64
+uclock_ns(void)
+{
+  return r_time() * ((struct usyscall*)USYSCALL)->nspercycle;
+}
+
+// The next free submission entry of ring r, zeroed, or 0
+// if the submission queue is full.
+struct sqe*
+ring_sqe(struct ring *r)
+{
+  struct sqe *s;
+
+  if(r->sqtail - r->sqhead == RING_SIZE)
+    return 0;
+  s = &r->sq[r->sqtail++ % RING_SIZE];
+  memset(s, 0, sizeof(*s));
+  return s;
+}
+
+// Have the kernel run the entries posted to r, as many as
+// there is room in the completion queue for.
+// Returns the number run, or -1.
+int
+ring_submit(struct ring *r)
+{
+  return ring_enter(r, r->sqtail - r->sqhead);
+}
+
+// The oldest completion in r not yet consumed, or 0.
+struct cqe*
+ring_cqe(struct ring *r)
+{
+  if(r->cqhead == r->cqtail)
+    return 0;
+  return &r->cq[r->cqhead % RING_SIZE];
+}
+
+// Consume the completion ring_cqe() returned.
+void
+ring_cqdone(struct ring *r)
+{
+  r->cqhead++;
+}
@@ -5,6 +5,7 @@
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+// A mutex makes it safe for threads.
 
 typedef long Align;
 
@@ -20,9 +21,10 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static struct mutex lock;
 
-void
-free(void *ap)
+static void
+freelocked(void *ap)
 {
   Header *bp, *p;
 
@@ -43,6 +45,14 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  mutex_lock(&lock);
+  freelocked(ap);
+  mutex_unlock(&lock);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,7 +66,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  freelocked((void*)(hp + 1));
   return freep;
 }
 
@@ -67,6 +77,7 @@ malloc(uint nbytes)
   uint nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  mutex_lock(&lock);
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +92,13 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
+      mutex_unlock(&lock);
       return (void*)(p + 1);
     }
     if(p == freep)
-      if((p = morecore(nunits)) == 0)
+      if((p = morecore(nunits)) == 0){
+        mutex_unlock(&lock);
         return 0;
+      }
   }
 }
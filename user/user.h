@@ -1,5 +1,11 @@
 struct stat;
 struct rtcdate;
+struct schedinfo;
+struct ring;
+struct iovec;
+struct pollfd;
+struct sqe;
+struct cqe;
 
 // system calls
 int fork(void);
@@ -23,6 +29,25 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int nice(int);
+int sched_setaffinity(int, uint);
+int sched_getaffinity(int);
+int schedinfo(int, struct schedinfo*);
+uint64 clock_ns(void);
+int sleep_ns(uint64);
+int ring_enter(struct ring*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int splice(int, int, int);
+int poll(struct pollfd*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +65,38 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int thread_create(void(*)(void*), void*);
+int thread_join(int, int*);
+
+// ulib.c: locks that only enter the kernel to wait.
+struct mutex {
+  int state;    // 0: free, 1: held, 2: held, maybe with waiters
+};
+
+struct cond {
+  int seq;      // bumped by every signal
+  int nwait;    // threads in cond_wait()
+};
+
+void mutex_lock(struct mutex*);
+int mutex_trylock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+
+// ulib.c: getpid(), uptime() and clock_ns() from the
+// usyscall page, without a system call.
+int ugetpid(void);
+int uuptime(void);
+uint64 uclock_ns(void);
+
+// ulib.c: batches of system calls through a ring;
+// see kernel/ring.h.
+struct sqe* ring_sqe(struct ring*);
+int ring_submit(struct ring*);
+struct cqe* ring_cqe(struct ring*);
+void ring_cqdone(struct ring*);
+
+// statistics.c
+int statistics(void*, int);
@@ -36,3 +36,22 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("nice");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("schedinfo");
+entry("clock_ns");
+entry("sleep_ns");
+entry("ring_enter");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("splice");
+entry("poll");
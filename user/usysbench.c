@@ -0,0 +1,84 @@
+//
+// the usyscall page: checks that ugetpid(), uuptime() and
+// uclock_ns() agree with the system calls they stand in
+// for, in a process and in a fork child, and times each
+// pair, the trapping path against the page read.
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NCALL 100000
+
+void
+checks(void)
+{
+  if(ugetpid() != getpid()){
+    printf("usysbench: ugetpid %d, getpid %d\n", ugetpid(), getpid());
+    exit(1);
+  }
+  int t = uptime(), u = uuptime();
+  if(u < t || u > t + 1){
+    printf("usysbench: uuptime %d, uptime %d\n", u, t);
+    exit(1);
+  }
+  uint64 n0 = clock_ns(), n1 = uclock_ns(), n2 = clock_ns();
+  if(n1 < n0 || n1 > n2){
+    printf("usysbench: uclock_ns out of order\n");
+    exit(1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 t0, t1, t2;
+  volatile int sink = 0;
+
+  checks();
+  int pid = fork();
+  if(pid < 0){
+    printf("usysbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    checks();
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  printf("usysbench: OK\n");
+
+  t0 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += getpid();
+  t1 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += ugetpid();
+  t2 = uclock_ns();
+  printf("getpid: %d ns per system call, %d ns per page read\n",
+         (int)((t1 - t0) / NCALL), (int)((t2 - t1) / NCALL));
+
+  t0 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += uptime();
+  t1 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += uuptime();
+  t2 = uclock_ns();
+  printf("uptime: %d ns per system call, %d ns per page read\n",
+         (int)((t1 - t0) / NCALL), (int)((t2 - t1) / NCALL));
+
+  t0 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += clock_ns();
+  t1 = uclock_ns();
+  for(int i = 0; i < NCALL; i++)
+    sink += uclock_ns();
+  t2 = uclock_ns();
+  printf("clock_ns: %d ns per system call, %d ns per page read\n",
+         (int)((t1 - t0) / NCALL), (int)((t2 - t1) / NCALL));
+  exit(0);
+}
@@ -0,0 +1,98 @@
+//
+// wakeup latency benchmark: pipe ping-pong between two
+// processes, first alone, then with many idle processes
+// asleep in the kernel. Each round trip is two sleep()s and
+// two wakeup()s, so the second run shows what idle sleepers
+// cost a wakeup.
+//
+// usage: wakebench [nidle]
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define ROUNDS 5000
+
+int
+pingpong(void)
+{
+  int a[2], b[2];
+  char c = 0;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf("wakebench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("wakebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(a[1]);
+    close(b[0]);
+    while(read(a[0], &c, 1) == 1)
+      write(b[1], &c, 1);
+    exit(0);
+  }
+  close(a[0]);
+  close(b[1]);
+
+  int t0 = uptime();
+  for(int i = 0; i < ROUNDS; i++){
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1){
+      printf("wakebench: ping-pong failed\n");
+      exit(1);
+    }
+  }
+  int t1 = uptime();
+
+  close(a[1]);
+  close(b[0]);
+  wait(0);
+  return t1 - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nidle = argc > 1 ? atoi(argv[1]) : 60;
+  int fds[2], n, last = -1;
+  char c;
+
+  printf("%d round trips, no idle processes: %d ticks\n", ROUNDS, pingpong());
+
+  // the idle processes sleep reading a pipe that stays
+  // empty until it is closed.
+  if(pipe(fds) < 0){
+    printf("wakebench: pipe failed\n");
+    exit(1);
+  }
+  for(n = 0; n < nidle; n++){
+    int pid = fork();
+    if(pid < 0){
+      // the process table is full: leave room for
+      // the ping-pong partner.
+      if(last > 0 && kill(last) == 0){
+        wait(0);
+        n--;
+      }
+      break;
+    }
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+    last = pid;
+  }
+  close(fds[0]);
+  sleep(2);
+
+  printf("%d round trips, %d idle processes: %d ticks\n", ROUNDS, n, pingpong());
+
+  close(fds[1]);
+  for(int i = 0; i < n; i++)
+    wait(0);
+  exit(0);
+}